@@ -1,5 +1,15 @@
+#define _GNU_SOURCE	// for ppoll
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <alsa/asoundlib.h>
+#include <gsl/gsl_blas.h>
 
 #include "anyloop.h"
 #include "logging.h"
@@ -7,14 +17,243 @@
 #include "aylp_alsa.h"
 
 
+// open playback devices, so aylp_alsa_capture can link to them
+static struct aylp_alsa_data *playbacks;
+static pthread_mutex_t playbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Sets buffer and period from the requested buffer_time and period_time. */
+static int set_buffer_period_time(struct aylp_alsa_data *data,
+	snd_pcm_hw_params_t *params
+){
+	int err;
+	int dir;	// we don't really care for now but see alsa docs
+	snd_pcm_t *handle = data->handle;
+
+	err = snd_pcm_hw_params_set_buffer_time_near(handle,
+		params, &data->buffer_time, &dir
+	);
+	if (err < 0) {
+		log_error("Unable to set buffer time %u for playback: %s",
+			data->buffer_time, snd_strerror(err)
+		);
+		return err;
+	}
+	err = snd_pcm_hw_params_get_buffer_size(params, &data->buffer_size);
+	if (err < 0) {
+		log_error("Unable to get buffer size for playback: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	log_trace("Buffer size set to %lu", data->buffer_size);
+
+	err = snd_pcm_hw_params_set_period_time_near(handle, params,
+		&data->period_time, &dir
+	);
+	if (err < 0) {
+		log_error("Unable to set period time %u for playback: %s",
+			data->period_time, snd_strerror(err)
+		);
+		return err;
+	}
+	err = snd_pcm_hw_params_get_period_size(params, &data->period_size,
+		&dir	// I don't understand how we can't get it exactly??
+	);
+	if (err < 0) {
+		log_error("Unable to get period size for playback: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	log_trace("Period size set to %lu", data->period_size);
+	return 0;
+}
+
+
+/** Negotiates the smallest buffer and period near latency_target_us.
+ * We ask for two periods per buffer, with the buffer as close to the target
+ * as the device allows. If the device can't go that low, we get its minimum.
+ */
+static int set_latency_target(struct aylp_alsa_data *data,
+	snd_pcm_hw_params_t *params
+){
+	int err;
+	int dir = 0;
+	snd_pcm_t *handle = data->handle;
+	snd_pcm_uframes_t target = (unsigned long long)data->latency_target_us
+		* data->rate / 1000000;
+	if (target < 2) target = 2;
+
+	unsigned periods = 2;
+	err = snd_pcm_hw_params_set_periods_min(handle, params, &periods, &dir);
+	if (err < 0) {
+		log_error("Unable to ask for %u periods for playback: %s",
+			periods, snd_strerror(err)
+		);
+		return err;
+	}
+
+	data->period_size = target / 2;
+	err = snd_pcm_hw_params_set_period_size_near(handle, params,
+		&data->period_size, &dir
+	);
+	if (err < 0) {
+		log_error("Unable to set period size %lu for playback: %s",
+			target / 2, snd_strerror(err)
+		);
+		return err;
+	}
+
+	data->buffer_size = target > 2 * data->period_size
+		? target : 2 * data->period_size;
+	err = snd_pcm_hw_params_set_buffer_size_near(handle, params,
+		&data->buffer_size
+	);
+	if (err < 0) {
+		log_error("Unable to set buffer size %lu for playback: %s",
+			target, snd_strerror(err)
+		);
+		return err;
+	}
+	// the buffer may have moved the period
+	err = snd_pcm_hw_params_get_period_size(params, &data->period_size,
+		&dir
+	);
+	if (err < 0) {
+		log_error("Unable to get period size for playback: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	snd_pcm_hw_params_get_buffer_time(params, &data->buffer_time, &dir);
+	snd_pcm_hw_params_get_period_time(params, &data->period_time, &dir);
+
+	if (data->buffer_size > target) {
+		log_warn("Latency target is %u us but smallest buffer is "
+			"%lu frames (%u us)", data->latency_target_us,
+			data->buffer_size, data->buffer_time
+		);
+	}
+	log_trace("Buffer size set to %lu, period size set to %lu",
+		data->buffer_size, data->period_size
+	);
+	return 0;
+}
+
+
+/** Sets buffer and period to exactly the sizes in data->sizes, which come from
+ * the profile or a reconfiguration.
+ */
+static int set_sizes(struct aylp_alsa_data *data,
+	snd_pcm_hw_params_t *params
+){
+	int err;
+	int dir = 0;
+	snd_pcm_t *handle = data->handle;
+
+	data->period_size = data->sizes.period_size;
+	err = snd_pcm_hw_params_set_period_size_near(handle, params,
+		&data->period_size, &dir
+	);
+	if (err < 0) {
+		log_error("Unable to set period size %lu: %s",
+			data->sizes.period_size, snd_strerror(err)
+		);
+		return err;
+	}
+	data->buffer_size = data->sizes.buffer_size;
+	err = snd_pcm_hw_params_set_buffer_size_near(handle, params,
+		&data->buffer_size
+	);
+	if (err < 0) {
+		log_error("Unable to set buffer size %lu: %s",
+			data->sizes.buffer_size, snd_strerror(err)
+		);
+		return err;
+	}
+	snd_pcm_hw_params_get_period_size(params, &data->period_size, &dir);
+	snd_pcm_hw_params_get_buffer_time(params, &data->buffer_time, &dir);
+	snd_pcm_hw_params_get_period_time(params, &data->period_time, &dir);
+	if (data->period_size != data->sizes.period_size
+	|| data->buffer_size != data->sizes.buffer_size) {
+		log_warn("Asked for period %lu, buffer %lu but got %lu, %lu",
+			data->sizes.period_size, data->sizes.buffer_size,
+			data->period_size, data->buffer_size
+		);
+	}
+	log_trace("Buffer size set to %lu, period size set to %lu",
+		data->buffer_size, data->period_size
+	);
+	return 0;
+}
+
+
+/** In direct mode, swaps a requested access or format the hardware can't do
+ * natively (there being no plug layer to convert) for the first one in our
+ * order of preference that it can.
+ */
+static void pick_native(struct aylp_alsa_data *data,
+	snd_pcm_hw_params_t *params
+){
+	static const snd_pcm_access_t accesses[] = {
+		SND_PCM_ACCESS_MMAP_INTERLEAVED,
+		SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
+		SND_PCM_ACCESS_RW_INTERLEAVED,
+		SND_PCM_ACCESS_RW_NONINTERLEAVED,
+	};
+	// ones we have conversion kernels for, widest first
+	static const snd_pcm_format_t formats[] = {
+		SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S32_BE,
+		SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S24_3BE,
+		SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S24_BE,
+		SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_FLOAT_BE,
+		SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S16_BE,
+		SND_PCM_FORMAT_U16_LE, SND_PCM_FORMAT_U16_BE,
+		SND_PCM_FORMAT_S8, SND_PCM_FORMAT_U8,
+	};
+	snd_pcm_t *handle = data->handle;
+	if (snd_pcm_hw_params_test_access(handle, params, data->access)) {
+		for (size_t i = 0; i < sizeof accesses / sizeof *accesses;
+		i++) {
+			if (snd_pcm_hw_params_test_access(handle, params,
+				accesses[i]
+			)) continue;
+			log_warn("%s can't do %s natively; using %s",
+				data->device,
+				snd_pcm_access_name(data->access),
+				snd_pcm_access_name(accesses[i])
+			);
+			data->access = accesses[i];
+			break;
+		}
+	}
+	if (snd_pcm_hw_params_test_format(handle, params, data->format)) {
+		for (size_t i = 0; i < sizeof formats / sizeof *formats; i++) {
+			if (snd_pcm_hw_params_test_format(handle, params,
+				formats[i]
+			)) continue;
+			log_warn("%s can't do %s natively; using %s",
+				data->device,
+				snd_pcm_format_name(data->format),
+				snd_pcm_format_name(formats[i])
+			);
+			data->format = formats[i];
+			break;
+		}
+	}
+}
+
+
 /** Sets hardware parameters from the data struct.
  * Specifically, sets: access, format, channels, rate, buffer time/size, period
- * time/size.
+ * time/size. The buffer and period come from data->sizes if we have them,
+ * then latency_target_us if it's set, or from buffer_time and period_time
+ * otherwise.
  */
 static int set_hwparams(struct aylp_alsa_data *data)
 {
 	int err;
-	int dir;	// we don't really care for now but see alsa docs
 	snd_pcm_t *handle = data->handle;
 	snd_pcm_hw_params_t *params;
 	snd_pcm_hw_params_alloca(&params);
@@ -27,6 +266,8 @@ static int set_hwparams(struct aylp_alsa_data *data)
 		return err;
 	}
 
+	if (data->direct != AYLP_ALSA_DIRECT_OFF) pick_native(data, params);
+
 	err = snd_pcm_hw_params_set_access(handle, params, data->access);
 	if (err < 0) {
 		log_error("Access type not available for playback: %s",
@@ -65,43 +306,32 @@ static int set_hwparams(struct aylp_alsa_data *data)
 		);
 	}
 
-	err = snd_pcm_hw_params_set_buffer_time_near(handle,
-		params, &data->buffer_time, &dir
-	);
-	if (err < 0) {
-		log_error("Unable to set buffer time %u for playback: %s",
-			data->buffer_time, snd_strerror(err)
-		);
-		return err;
-	}
-	err = snd_pcm_hw_params_get_buffer_size(params, &data->buffer_size);
-	if (err < 0) {
-		log_error("Unable to get buffer size for playback: %s",
-			snd_strerror(err)
-		);
-		return err;
+	if (data->wakeup == AYLP_ALSA_WAKE_TIMER) {
+		if (snd_pcm_hw_params_can_disable_period_wakeup(params)) {
+			err = snd_pcm_hw_params_set_period_wakeup(handle,
+				params, 0
+			);
+		} else {
+			err = -ENOSYS;
+		}
+		if (err < 0) {
+			log_warn("Can't disable period wakeups, so falling "
+				"back to irq wakeups: %s", snd_strerror(err)
+			);
+			data->wakeup = AYLP_ALSA_WAKE_IRQ;
+		}
 	}
-	log_trace("Buffer size set to %lu", data->buffer_size);
 
-	err = snd_pcm_hw_params_set_period_time_near(handle, params,
-		&data->period_time, &dir
-	);
-	if (err < 0) {
-		log_error("Unable to set period time %u for playback: %s",
-			data->period_time, snd_strerror(err)
-		);
-		return err;
-	}
-	err = snd_pcm_hw_params_get_period_size(params, &data->period_size,
-		&dir	// I don't understand how we can't get it exactly??
-	);
-	if (err < 0) {
-		log_error("Unable to get period size for playback: %s",
-			snd_strerror(err)
-		);
-		return err;
+	if (data->have_sizes) {
+		err = set_sizes(data, params);
+		if (err < 0) return err;
+	} else if (data->latency_target_us) {
+		err = set_latency_target(data, params);
+		if (err < 0) return err;
+	} else {
+		err = set_buffer_period_time(data, params);
+		if (err < 0) return err;
 	}
-	log_trace("Period size set to %lu", data->period_size);
 
 	// write the parameters to device
 	err = snd_pcm_hw_params(handle, params);
@@ -117,6 +347,18 @@ static int set_hwparams(struct aylp_alsa_data *data)
 	return 0;
 }
 
+/** Free space at which a paced write of frames is due: the frames, plus
+ * whatever must stay empty to hold the queue at target_delay.
+ */
+static snd_pcm_uframes_t pace_room(const struct aylp_alsa_data *data,
+	snd_pcm_uframes_t frames
+){
+	snd_pcm_uframes_t target = data->target_delay;
+	if (target > data->buffer_size) target = data->buffer_size;
+	return frames + (target ? data->buffer_size - target : 0);
+}
+
+
 /** Sets software parameters based on hardware parameters. */
 static int set_swparams(struct aylp_alsa_data *data)
 {
@@ -146,9 +388,10 @@ static int set_swparams(struct aylp_alsa_data *data)
 		return err;
 	}
 
-	// allow the transfer when at least period_size samples can be processed
+	// allow the transfer when at least period_size samples can be
+	// processed, or when there's room for a paced write
 	err = snd_pcm_sw_params_set_avail_min(handle, params,
-		data->period_size
+		data->pace ? pace_room(data, data->pace) : data->period_size
 	);
 	if (err < 0) {
 		log_error("Unable to set avail min for playback: %s",
@@ -162,6 +405,24 @@ static int set_swparams(struct aylp_alsa_data *data)
 	snd_pcm_sw_params_get_boundary(params, &boundary);
 	snd_pcm_sw_params_set_stop_threshold(handle, params, boundary);
 
+	// timestamp hw pointer readings on the same clock as everything else
+	if (data->clock_on) {
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, params,
+			SND_PCM_TSTAMP_ENABLE
+		);
+		if (err >= 0) {
+			err = snd_pcm_sw_params_set_tstamp_type(handle, params,
+				SND_PCM_TSTAMP_TYPE_MONOTONIC
+			);
+		}
+		if (err < 0) {
+			log_error("Unable to enable timestamps: %s",
+				snd_strerror(err)
+			);
+			return err;
+		}
+	}
+
 	// write the parameters to the playback device
 	err = snd_pcm_sw_params(handle, params);
 	if (err < 0) {
@@ -177,175 +438,1885 @@ static int set_swparams(struct aylp_alsa_data *data)
 }
 
 
-/** Process one period according to data and state. */
-static int process_period(struct aylp_alsa_data *data, struct aylp_state *state)
+/** Parses an access name like "MMAP_INTERLEAVED" (case-insensitive). */
+static int parse_access(const char *name, snd_pcm_access_t *access)
 {
-	int err;
-	// check for suspend event
-	if (UNLIKELY(snd_pcm_state(data->handle) == SND_PCM_STATE_SUSPENDED)) {
-		log_warn("Detected suspend event");
-		// wait until suspend flag is released
-		while ((err = snd_pcm_resume(data->handle)) == -EAGAIN)
-			sleep(1);
-		if (err < 0) {
-			err = snd_pcm_prepare(data->handle);
-			if (err < 0) {
-				log_error("Can't recover from suspend; prepare "
-					"failed: %s", snd_strerror(err)
-				);
-				return err;
-			}
+	if (!name) return -1;
+	for (int a = 0; a <= SND_PCM_ACCESS_LAST; a++) {
+		const char *a_name = snd_pcm_access_name(a);
+		if (a_name && !strcasecmp(name, a_name)) {
+			*access = a;
+			return 0;
 		}
 	}
+	return -1;
+}
 
-	// make sure we have a period available
-	snd_pcm_uframes_t avail = snd_pcm_avail_update(data->handle);
-	if (UNLIKELY((snd_pcm_sframes_t)avail < 0)) {
-		log_warn("Failed to check availability: %s",
-			snd_strerror(avail)
-		);
-		data->needs_start = true;
-		return avail;
-	} else if (UNLIKELY(avail < data->period_size)) {
-		if (data->needs_start) {
-			data->needs_start = false;
-			log_trace("Starting pcm");
-			err = snd_pcm_start(data->handle);
-			if (err < 0) {
-				log_error("Start error: %s", snd_strerror(err));
-				return err;
-			}
-		} else {
-			err = snd_pcm_wait(data->handle, -1);
-			if (err < 0) {
-				log_warn("snd_pcm_wait error: %s",
-					snd_strerror(err)
-				);
-				data->needs_start = true;
-				return err;
-			}
-		}
-		return 0;
-		// Instead of return 0 above, we could put this whole thing in a
-		// loop and simply `continue`. Depends on if we want to wait for
-		// ALSA to be ready to take our data or if we just want to get
-		// on with the loop.
-	}
 
-	// write frames
-	snd_pcm_uframes_t offset, frames, size;
-	const snd_pcm_channel_area_t *my_areas;
-	size = data->period_size;
-	while (size > 0) {
-		frames = size;
-		err = snd_pcm_mmap_begin(data->handle,
-			&my_areas, &offset, &frames
-		);
+/** Returns the current CLOCK_MONOTONIC time in ns. */
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/** Polls for room in the buffer until data->deadline_ns.
+ * Returns 0 if there's room, -EAGAIN if we ran out of time, or a negative error
+ * code.
+ */
+static int wait_deadline(struct aylp_alsa_data *data)
+{
+	int err;
+	while (true) {
+		long long left = data->deadline_ns - now_ns();
+		if (left <= 0) return -EAGAIN;
+		struct timespec ts = {
+			.tv_sec = left / 1000000000,
+			.tv_nsec = left % 1000000000,
+		};
+		err = ppoll(data->pfds, data->n_pfds, &ts, NULL);
 		if (err < 0) {
-			log_error("mmap_begin error: %s", snd_strerror(err));
-			data->needs_start = true;
-			return err;
-		}
-		unsigned char *samples[data->channels];
-		// verify and prepare the contents of areas
-		for (unsigned c = 0; c < data->channels; c++) {
-			// check that offset to first sample is integer number
-			// of bytes
-			if (my_areas[c].first & 0x8) {
-				log_error("areas[%u].first == %u, aborting",
-					c, my_areas[c].first
-				);
-				return -1;
-			}
-			samples[c] = (unsigned char *)my_areas[c].addr
-				+ (my_areas[c].first / 8);
-			// check that step size is integer number of shorts
-			if (my_areas[c].step & 0xF) {
-				log_error("areas[%u].step == %u, aborting",
-					c, my_areas[c].step
-				);
-				return -1;
-			}
-			samples[c] += offset * my_areas[c].step/8;
-		}
-		// fill the channel areas
-		for (int count = frames-1; count >= 0; count--) {
-			for (unsigned c = 0; c < data->channels; c++) {
-				double f = state->vector->data[c];
-				int res = data->maxval;
-				if (data->to_unsigned) res *= f/2+0.5;
-				else res *= f/2;
-				if (UNLIKELY(data->big_endian)) {
-					for (int i=0; i < data->format_bits/8;
-					i++) {
-						*(samples[c]
-						+ data->phys_bps - 1 - i)
-							= (res >> i*8) & 0xFF;
-					}
-				} else {
-					for (int i=0; i < data->format_bits/8;
-					i++) {
-						*(samples[c] + i)
-							= (res >> i*8) & 0xFF;
-					}
-				}
-				samples[c] += my_areas[c].step/8;
-			}
+			if (errno == EINTR) continue;
+			return -errno;
 		}
-
-		snd_pcm_sframes_t err = snd_pcm_mmap_commit(data->handle,
-			offset, frames
+		if (err == 0) return -EAGAIN;
+		unsigned short revents;
+		err = snd_pcm_poll_descriptors_revents(data->handle,
+			data->pfds, data->n_pfds, &revents
 		);
-		if (UNLIKELY(err < 0 || (snd_pcm_uframes_t)err != frames)) {
-			log_warn("mmap_commit error: %s", snd_strerror(err));
-			data->needs_start = true;
-			return err;
+		if (err < 0) return err;
+		if (revents & POLLERR) {
+			if (snd_pcm_state(data->handle) == SND_PCM_STATE_XRUN)
+				return -EPIPE;
+			return -EIO;
 		}
-		size -= frames;
+		if (revents & POLLOUT) return 0;
+	}
+}
+
+
+/** Returns when a wait that starts now should give up (CLOCK_MONOTONIC ns):
+ * the deadline in deadline mode, wait_ms from now otherwise, or 0 for never.
+ */
+static long long wait_end(struct aylp_alsa_data *data)
+{
+	if (data->budget_us) return data->deadline_ns;
+	if (data->wait_ms < 0) return 0;
+	return now_ns() + data->wait_ms * 1000000LL;
+}
+
+
+/** Sleeps until the hw pointer should have freed room for size frames.
+ * With period wakeups off, there's no interrupt to wake poll() for us, so we
+ * work out from the rate when the room will be there. Returns 0 once we've
+ * slept, -EAGAIN if that would be past the end of our wait, or a negative
+ * error code.
+ */
+static int wait_timer(struct aylp_alsa_data *data, snd_pcm_uframes_t size)
+{
+	// snd_pcm_avail() syncs with the hw pointer, unlike avail_update()
+	snd_pcm_sframes_t avail = snd_pcm_avail(data->handle);
+	if (avail < 0) return avail;
+	if ((snd_pcm_uframes_t)avail >= size) return 0;
+	long long end = wait_end(data);
+	long long wake = now_ns() + (long long)(size - avail) * 1000000000LL
+		/ data->rate;
+	if (end && wake > end) {
+		// no point sleeping if the room won't be there in time
+		if (data->budget_us) return -EAGAIN;
+		wake = end;
 	}
+	struct timespec ts = {
+		.tv_sec = wake / 1000000000,
+		.tv_nsec = wake % 1000000000,
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+		== EINTR);
 	return 0;
 }
 
 
-int aylp_alsa_init(struct aylp_device *self)
+/** Spins on the hw pointer until there's room for size frames.
+ * Returns 0 if there's room, -EAGAIN if we ran out of time, or a negative
+ * error code.
+ */
+static int wait_busy(struct aylp_alsa_data *data, snd_pcm_uframes_t size)
+{
+	long long end = wait_end(data);
+	while (true) {
+		snd_pcm_sframes_t avail = snd_pcm_avail(data->handle);
+		if (avail < 0) return avail;
+		if ((snd_pcm_uframes_t)avail >= size) return 0;
+		if (end && now_ns() >= end) return -EAGAIN;
+		if (atomic_load_explicit(&data->stop, memory_order_relaxed))
+			return -EAGAIN;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+}
+
+
+/** Waits for room for size frames however data->wakeup says to.
+ * Returns 0 if there's (probably) room, -EAGAIN if we ran out of time, or a
+ * negative error code.
+ */
+static int wait_room(struct aylp_alsa_data *data, snd_pcm_uframes_t size)
 {
 	int err;
-	self->device_data = xcalloc(1, sizeof(struct aylp_alsa_data));
-	struct aylp_alsa_data *data = self->device_data;
-	// attach methods
-	self->process = &aylp_alsa_process;
-	self->close = &aylp_alsa_close;
+	switch (data->wakeup) {
+	case AYLP_ALSA_WAKE_TIMER:
+		return wait_timer(data, size);
+	case AYLP_ALSA_WAKE_BUSY:
+		return wait_busy(data, size);
+	case AYLP_ALSA_WAKE_IRQ:
+	default:
+		if (data->budget_us) return wait_deadline(data);
+		err = snd_pcm_wait(data->handle, data->wait_ms);
+		if (err < 0) return err;
+		return err ? 0 : -EAGAIN;
+	}
+}
 
-	// default params
-	data->device = "front";
-	data->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
-	data->format = SND_PCM_FORMAT_S16;
-	data->channels = 2;
-	data->rate = 200000;
-	data->buffer_time = 0;
-	data->period_time = 0;
-	/* TODO
-	// parse the params json into our data struct
-	if (!self->params) {
-		log_error("No params object found.");
+
+/** Counts time spent waiting since t0 in our stats. */
+static void count_wait(struct aylp_alsa_data *data, long long t0)
+{
+	if (data->stats_block)
+		aylp_alsa_hist_add(&data->stats.wait_ns, now_ns() - t0);
+}
+
+
+/** Encodes the frame src holds into data->pattern, unless it's the same frame
+ * we encoded last time.
+ */
+static void encode_hold(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src
+){
+	bool same = data->pattern_ok;
+	for (unsigned c = 0; c < data->channels; c++) {
+		double v = src->data[c * src->ch_stride];
+		// compare bits, so a held NaN doesn't re-encode every time
+		if (memcmp(&v, &data->held[c], sizeof v)) {
+			data->held[c] = v;
+			same = false;
+		}
+	}
+	if (same) return;
+	size_t bps = data->phys_bps;
+	size_t n = data->pattern_frames;
+	if (data->planar) {
+		// one run of n samples per channel
+		for (unsigned c = 0; c < data->channels; c++) {
+			data->conv(data->pattern + c * n * bps, bps,
+				&data->held[c], 0, n
+			);
+		}
+	} else {
+		// one frame, then double it up to n frames
+		size_t frame_bytes = data->channels * bps;
+		for (unsigned c = 0; c < data->channels; c++) {
+			data->conv(data->pattern + c * bps, frame_bytes,
+				&data->held[c], 0, 1
+			);
+		}
+		size_t total = n * frame_bytes, filled = frame_bytes;
+		while (filled < total) {
+			size_t chunk = filled < total - filled
+				? filled : total - filled;
+			memcpy(data->pattern + filled, data->pattern, chunk);
+			filled += chunk;
+		}
+	}
+	data->pattern_ok = true;
+}
+
+
+/** Copies total bytes to dst from a pattern of pat_bytes, over and over,
+ * starting `start` bytes into it.
+ */
+static void copy_runs(unsigned char *restrict dst,
+	const unsigned char *restrict pat, size_t pat_bytes, size_t start,
+	size_t total
+){
+	while (total) {
+		size_t n = pat_bytes - start;
+		if (n > total) n = total;
+		memcpy(dst, pat + start, n);
+		dst += n;
+		total -= n;
+		start = 0;
+	}
+}
+
+
+/** Fills frames frames of areas from offset with src's encoded frames,
+ * starting `done` frames in. These are plain memcpys from a cached buffer,
+ * so they get the widest stores the target has and never read back from the
+ * (possibly uncached) buffer. Returns false if the areas aren't laid out
+ * like the encoded frames.
+ */
+static bool fill_encoded(struct aylp_alsa_data *data,
+	const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t done,
+	snd_pcm_uframes_t frames
+){
+	size_t bps = data->phys_bps;
+	unsigned bits = bps * 8;
+	size_t n = src->enc_frames;
+	size_t start = (src->enc_pos + done) % n;
+	if (data->planar) {
+		for (unsigned c = 0; c < data->channels; c++) {
+			if (areas[c].step != bits || areas[c].first % 8)
+				return false;
+		}
+		for (unsigned c = 0; c < data->channels; c++) {
+			copy_runs((unsigned char *)areas[c].addr
+					+ areas[c].first / 8 + offset * bps,
+				src->enc + c * n * bps, n * bps, start * bps,
+				frames * bps
+			);
+		}
+		return true;
+	}
+	unsigned step = data->channels * bits;
+	if (areas[0].first % 8) return false;
+	for (unsigned c = 0; c < data->channels; c++) {
+		if (areas[c].addr != areas[0].addr || areas[c].step != step
+		|| areas[c].first != areas[0].first + c * bits)
+			return false;
+	}
+	size_t frame_bytes = step / 8;
+	copy_runs((unsigned char *)areas[0].addr + areas[0].first / 8
+			+ offset * frame_bytes,
+		src->enc, n * frame_bytes, start * frame_bytes,
+		frames * frame_bytes
+	);
+	return true;
+}
+
+
+/** Converts frames frames from src, starting at frame `done`, into areas
+ * starting at offset. Returns 0 or a negative error code.
+ */
+static int convert_areas(struct aylp_alsa_data *data,
+	const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t done,
+	snd_pcm_uframes_t frames
+){
+	// holding a value is the common case, and it's just a copy
+	if (src->enc && fill_encoded(data, areas, offset, src, done, frames))
+		return 0;
+	for (unsigned c = 0; c < data->channels; c++) {
+		// check that offset to first sample and step size are
+		// integer numbers of bytes
+		if (UNLIKELY(areas[c].first % 8 || areas[c].step % 8)) {
+			log_error("areas[%u] has first %u and step %u, "
+				"aborting", c, areas[c].first, areas[c].step
+			);
+			return -EINVAL;
+		}
+		unsigned char *samples = (unsigned char *)areas[c].addr
+			+ areas[c].first / 8 + offset * (areas[c].step / 8);
+		data->conv(samples, areas[c].step / 8,
+			src->data + c * src->ch_stride
+				+ done * src->frame_stride,
+			src->frame_stride, frames
+		);
+	}
+	return 0;
+}
+
+
+/** Converts size frames from src straight into the render file. Returns the
+ * number of frames written or a negative error code.
+ */
+static snd_pcm_sframes_t fill_render(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t size
+){
+	unsigned bits = data->phys_bps * 8;
+	snd_pcm_uframes_t done = 0;
+	while (done < size) {
+		size_t frames = size - done;
+		unsigned char *p = aylp_alsa_render_begin(&data->render,
+			&frames
+		);
+		if (UNLIKELY(!p)) return -ENOMEM;
+		for (unsigned c = 0; c < data->channels; c++) {
+			data->areas[c].addr = p;
+			data->areas[c].first = c * bits;
+			data->areas[c].step = data->channels * bits;
+		}
+		int err = convert_areas(data, data->areas, 0, src, done,
+			frames
+		);
+		if (UNLIKELY(err < 0)) return err;
+		aylp_alsa_render_commit(&data->render, frames);
+		done += frames;
+	}
+	return done;
+}
+
+
+/** Converts size frames from src into the mmap areas and commits them.
+ * Returns the number of frames written or a negative error code.
+ */
+static snd_pcm_sframes_t fill_mmap(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t size
+){
+	int err;
+	snd_pcm_uframes_t offset, frames, done = 0;
+	const snd_pcm_channel_area_t *my_areas;
+	while (done < size) {
+		frames = size - done;
+		err = snd_pcm_mmap_begin(data->handle,
+			&my_areas, &offset, &frames
+		);
+		if (UNLIKELY(err < 0)) {
+			log_warn("mmap_begin error: %s", snd_strerror(err));
+			return err;
+		}
+		err = convert_areas(data, my_areas, offset, src, done, frames);
+		if (UNLIKELY(err < 0)) return err;
+
+		snd_pcm_sframes_t res = snd_pcm_mmap_commit(data->handle,
+			offset, frames
+		);
+		if (UNLIKELY(res < 0 || (snd_pcm_uframes_t)res != frames)) {
+			log_warn("mmap_commit error: %s", snd_strerror(res));
+			return res < 0 ? res : -EPIPE;
+		}
+		done += frames;
+	}
+	return done;
+}
+
+
+/** Converts size frames from src into our staging buffer and writes them with
+ * snd_pcm_writei() or snd_pcm_writen(), a period at a time.
+ * Returns the number of frames written or a negative error code.
+ */
+static snd_pcm_sframes_t fill_rw(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t size
+){
+	size_t frame_bytes = data->channels * data->phys_bps;
+	snd_pcm_uframes_t done = 0;
+	while (done < size) {
+		snd_pcm_uframes_t frames = size - done;
+		if (frames > data->period_size) frames = data->period_size;
+		int err = convert_areas(data, data->areas, 0, src, done,
+			frames
+		);
+		if (UNLIKELY(err < 0)) return err;
+		snd_pcm_uframes_t written = 0;
+		while (written < frames) {
+			snd_pcm_sframes_t res;
+			if (data->planar) {
+				for (unsigned c = 0; c < data->channels; c++) {
+					data->planes[c] = data->samples
+						+ c * data->plane_bytes
+						+ written * data->phys_bps;
+				}
+				res = snd_pcm_writen(data->handle, data->planes,
+					frames - written
+				);
+			} else {
+				res = snd_pcm_writei(data->handle,
+					data->samples + written * frame_bytes,
+					frames - written
+				);
+			}
+			if (res == -EAGAIN) return done + written;
+			if (UNLIKELY(res < 0)) {
+				log_warn("write error: %s", snd_strerror(res));
+				return res;
+			}
+			written += res;
+		}
+		done += frames;
+	}
+	return done;
+}
+
+
+/** Writes size frames from src to the pcm with whatever access we have. */
+static snd_pcm_sframes_t fill_areas(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t size
+){
+	struct aylp_alsa_src held;
+	if (src->frame_stride == 0 && !src->enc) {
+		encode_hold(data, src);
+		held = *src;
+		held.enc = data->pattern;
+		held.enc_frames = data->pattern_frames;
+		held.enc_pos = 0;
+		src = &held;
+	}
+	snd_pcm_sframes_t done = data->render_path
+		? fill_render(data, src, size)
+		: data->rw ? fill_rw(data, src, size)
+		: fill_mmap(data, src, size);
+	if (done > 0) data->written += done;
+	return done;
+}
+
+
+/** Takes a timestamped reading of the hw pointer for the clock estimate. */
+static void read_clock(struct aylp_alsa_data *data)
+{
+	if (snd_pcm_status(data->handle, data->status) < 0) return;
+	if (snd_pcm_status_get_state(data->status) != SND_PCM_STATE_RUNNING)
+		return;
+	snd_htimestamp_t ts;
+	snd_pcm_status_get_htstamp(data->status, &ts);
+	if (!ts.tv_sec && !ts.tv_nsec) return;	// no timestamp support
+	// never block the writing thread; we'll catch the next one
+	if (pthread_mutex_trylock(&data->clock_lock)) return;
+	aylp_alsa_clock_update(&data->clock, data->written,
+		snd_pcm_status_get_delay(data->status),
+		ts.tv_sec * 1000000000LL + ts.tv_nsec
+	);
+	pthread_mutex_unlock(&data->clock_lock);
+}
+
+
+/** Starts a new clock measurement, since frames were dropped. */
+static void reset_clock(struct aylp_alsa_data *data)
+{
+	if (!data->clock_on) return;
+	pthread_mutex_lock(&data->clock_lock);
+	aylp_alsa_clock_reset(&data->clock);
+	pthread_mutex_unlock(&data->clock_lock);
+}
+
+
+/** Starts the pcm. A linked card only starts the group once every card's
+ * buffer is full, and returns -EAGAIN until then.
+ */
+static int start_pcm(struct aylp_alsa_data *data)
+{
+	struct aylp_alsa_group *g = data->group;
+	if (!g) return snd_pcm_start(data->handle);
+	int err = 0;
+	pthread_mutex_lock(&g->lock);
+	// another card may have started us all already
+	if (snd_pcm_state(data->handle) != SND_PCM_STATE_RUNNING) {
+		data->full = true;
+		for (unsigned k = 0; k < g->n_cards; k++) {
+			if (!g->cards[k].full) err = -EAGAIN;
+		}
+		if (!err) {
+			err = snd_pcm_start(data->handle);
+			for (unsigned k = 0; k < g->n_cards; k++)
+				g->cards[k].full = false;
+		}
+	}
+	pthread_mutex_unlock(&g->lock);
+	return err;
+}
+
+
+/** Catches an underrun the card played through (see
+ * aylp_alsa_stats_underrun()) in avail, as just read from the pcm: counts it,
+ * and skips what has played since, so we write where the card is now rather
+ * than behind it. Returns avail as it is afterwards, or a negative error code.
+ */
+static snd_pcm_sframes_t check_underrun(struct aylp_alsa_data *data,
+	snd_pcm_sframes_t avail
+){
+	if (data->needs_start) return avail;
+	snd_pcm_uframes_t over = aylp_alsa_stats_underrun(&data->stats, avail,
+		data->buffer_size
+	);
+	if (LIKELY(!over)) return avail;
+	log_warn("Underrun by %lu frames", over);
+	snd_pcm_sframes_t skipped = snd_pcm_forward(data->handle, over);
+	if (UNLIKELY(skipped < 0)) return skipped;
+	return avail - skipped;
+}
+
+
+/** Recovers from an xrun (-EPIPE) or suspend (-ESTRPIPE) in place.
+ * Once the pcm is prepared again, we fill the fresh buffer with the last output
+ * we wrote and restart right away, so an underrun costs one glitch rather than
+ * an error. Returns 0 if we recovered, -EAGAIN if the card is still suspended
+ * and we're out of time, or err if it's something we can't recover from.
+ */
+static int recover(struct aylp_alsa_data *data, int err)
+{
+	if (err == -ESTRPIPE) {
+		if (!data->suspended) {
+			log_warn("Recovering from suspend");
+			data->stats.suspends++;
+			data->suspended = true;
+		}
+		// wait until the suspend flag is released
+		while ((err = snd_pcm_resume(data->handle)) == -EAGAIN) {
+			if (data->budget_us && now_ns() >= data->deadline_ns)
+				return -EAGAIN;
+			struct timespec ts = {.tv_nsec = 10000000};
+			nanosleep(&ts, NULL);
+		}
+		data->suspended = false;
+		if (err < 0) err = snd_pcm_prepare(data->handle);
+	} else if (err == -EPIPE) {
+		log_warn("Recovering from xrun");
+		data->stats.xruns++;
+		err = snd_pcm_prepare(data->handle);
+	} else {
+		data->needs_start = true;
+		return err;
+	}
+	reset_clock(data);
+	if (err < 0) {
+		log_error("Can't recover; prepare failed: %s",
+			snd_strerror(err)
+		);
+		data->needs_start = true;
+		return err;
+	}
+	// a successful resume picks up where it left off
+	if (snd_pcm_state(data->handle) == SND_PCM_STATE_RUNNING)
+		return 0;
+
+	const struct aylp_alsa_src last = {
+		.data = data->last,
+		.ch_stride = 1,
+		.frame_stride = 0,
+	};
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(data->handle);
+	// refill only as deep as we're keeping the queue
+	if (data->target_delay && avail > (snd_pcm_sframes_t)data->target_delay)
+		avail = data->target_delay;
+	if (avail > 0) {
+		snd_pcm_sframes_t done = fill_areas(data, &last, avail);
+		if (done < 0) {
+			data->needs_start = true;
+			return done;
+		}
+	}
+	err = start_pcm(data);
+	if (err == -EAGAIN) {
+		// the rest of the group will start us once they're full
+		data->needs_start = true;
+		return 0;
+	}
+	if (err < 0) {
+		log_error("Restart error: %s", snd_strerror(err));
+		data->needs_start = true;
+		return err;
+	}
+	data->needs_start = false;
+	data->started = true;
+	data->stats.restarts++;
+	return 0;
+}
+
+
+/** (Re)allocates the cache-aligned staging buffer of one period that rw access
+ * converts into, with one aligned plane per channel if the device wants them
+ * separate. Returns 0 or -1.
+ */
+static int alloc_staging(struct aylp_alsa_data *data)
+{
+	unsigned bits = snd_pcm_format_physical_width(data->format);
+	size_t period_bytes = data->period_size * bits / 8;
+	data->plane_bytes = (period_bytes + 63) & ~(size_t)63;
+	size_t total = data->channels * data->plane_bytes;
+	free(data->samples);	// from aligned_alloc()
+	data->samples = aligned_alloc(64, total);
+	if (!data->samples) {
+		log_error("Couldn't allocate staging buffer");
 		return -1;
 	}
-	json_object_object_foreach(self->params, key, val) {
+	if (!data->planes)
+		data->planes = xcalloc(data->channels, sizeof(void *));
+	if (!data->areas) {
+		data->areas = xcalloc(data->channels,
+			sizeof(snd_pcm_channel_area_t)
+		);
+	}
+	for (unsigned c = 0; c < data->channels; c++) {
+		if (data->planar) {
+			data->areas[c].addr = data->samples
+				+ c * data->plane_bytes;
+			data->areas[c].first = 0;
+			data->areas[c].step = bits;
+		} else {
+			data->areas[c].addr = data->samples;
+			data->areas[c].first = c * bits;
+			data->areas[c].step = data->channels * bits;
+		}
+	}
+	return 0;
+}
+
+
+/** Drops the pcm, sets it up again at rate with the given period and buffer
+ * sizes, and leaves it to be refilled and started by process_period(). If the
+ * device won't take the new setup, we go back to the old one and still return
+ * the error. Returns 0 or a negative error code.
+ */
+static int reconfigure(struct aylp_alsa_data *data, unsigned rate,
+	snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size
+){
+	const unsigned old_rate = data->rate;
+	const struct aylp_alsa_profile old = {
+		.period_size = data->period_size,
+		.buffer_size = data->buffer_size,
+	};
+	if (data->group) {
+		// dropping one card would stop the whole group
+		log_warn("Can't reconfigure linked cards");
+		return -EINVAL;
+	}
+	int err = snd_pcm_drop(data->handle);
+	if (err < 0) {
+		log_error("Can't drop pcm to reconfigure: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	data->rate = rate;
+	data->sizes.period_size = period_size;
+	data->sizes.buffer_size = buffer_size;
+	data->have_sizes = true;
+	err = set_hwparams(data);
+	if (!err) err = set_swparams(data);
+	if (err) {
+		log_warn("Reconfiguration failed; going back to %u Hz, period "
+			"%lu, buffer %lu", old_rate, old.period_size,
+			old.buffer_size
+		);
+		data->rate = old_rate;
+		data->sizes = old;
+		int back = set_hwparams(data);
+		if (!back) back = set_swparams(data);
+		if (back) {
+			log_error("Can't restore the old setup: %s",
+				snd_strerror(back)
+			);
+			return back;
+		}
+	}
+	if (data->rw && alloc_staging(data)) return -ENOMEM;
+	if (data->target_delay > data->buffer_size)
+		data->target_delay = data->buffer_size;
+	// the oscillators pick up the new rate with the next vector
+	if (data->synth_on) data->synth.rate = data->rate;
+	if (data->clock_on) {
+		pthread_mutex_lock(&data->clock_lock);
+		aylp_alsa_clock_init(&data->clock, data->rate,
+			data->clock_interval_ms * 1000000LL, 0.1
+		);
+		pthread_mutex_unlock(&data->clock_lock);
+	}
+	data->needs_start = true;
+	if (err) return err;
+	log_info("Reconfigured to %u Hz, period %lu, buffer %lu",
+		data->rate, data->period_size, data->buffer_size
+	);
+	return 0;
+}
+
+
+/** Applies a reconfiguration queued by aylp_alsa_reconfigure(). A request the
+ * device won't take leaves us on the old setup, so it's not an error for the
+ * write path (and if even that's gone, the next write says so).
+ */
+static void apply_pending(struct aylp_alsa_data *data)
+{
+	pthread_mutex_lock(&data->reconf_lock);
+	struct aylp_alsa_reconf req = data->reconf;
+	atomic_store_explicit(&data->reconf_pending, false,
+		memory_order_relaxed
+	);
+	pthread_mutex_unlock(&data->reconf_lock);
+	unsigned rate = req.rate ? req.rate : data->rate;
+	snd_pcm_uframes_t period = req.period_size
+		? req.period_size : data->period_size;
+	snd_pcm_uframes_t buffer = req.buffer_size ? req.buffer_size
+		: period * (data->buffer_size / data->period_size);
+	if (reconfigure(data, rate, period, buffer) < 0)
+		log_warn("Couldn't apply the requested reconfiguration");
+}
+
+
+/** Adaptive period sizing: once per adapt_interval_ms, double the period if
+ * there were xruns, or halve it if there have been none for long enough. Each
+ * time we have to grow, we wait twice as many clean intervals before trying
+ * to shrink again, so we settle just above the size that underruns.
+ */
+static void adapt_period(struct aylp_alsa_data *data)
+{
+	long long now = now_ns();
+	if (now < data->adapt_next_ns) return;
+	data->adapt_next_ns = now + data->adapt_interval_ms * 1000000LL;
+	uint64_t xruns = data->stats.xruns - data->adapt_xruns;
+	data->adapt_xruns = data->stats.xruns;
+	snd_pcm_uframes_t period = data->period_size;
+	unsigned periods = data->buffer_size / data->period_size;
+	if (xruns) {
+		data->adapt_clean = 0;
+		if (data->adapt_patience < 64) data->adapt_patience *= 2;
+		if (period * 2 > data->adapt_max_period) return;
+		period *= 2;
+	} else if (++data->adapt_clean >= data->adapt_patience) {
+		data->adapt_clean = 0;
+		if (period / 2 < data->adapt_min_period) return;
+		period /= 2;
+	} else {
+		return;
+	}
+	log_info("Adapting period from %lu to %lu (%llu xruns)",
+		data->period_size, period, (unsigned long long)xruns
+	);
+	if (reconfigure(data, data->rate, period, period * periods) < 0) {
+		log_warn("Giving up on adapting the period");
+		data->adapt = false;
+	}
+}
+
+
+/** Writes size frames from src, which there's room for, and does the
+ * bookkeeping. Returns the number of frames written or a negative error code.
+ */
+static snd_pcm_sframes_t put_frames(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t size
+){
+	long long t0 = data->stats_block ? now_ns() : 0;
+	snd_pcm_sframes_t done = fill_areas(data, src, size);
+	if (UNLIKELY(done < 0)) {
+		// a render file has nothing to recover
+		if (data->render_path) return done;
+		int err = recover(data, done);
+		return err ? err : 0;
+	}
+	// a nonblocking write can come back with nothing
+	if (UNLIKELY(done == 0)) return 0;
+	// remember where we left off in case we need to recover
+	for (unsigned c = 0; c < data->channels; c++) {
+		data->last[c] = src->data[c * src->ch_stride
+			+ (done - 1) * src->frame_stride];
+	}
+	data->stats.periods++;
+	data->stats.frames += done;
+	if (data->stats_block)
+		aylp_alsa_hist_add(&data->stats.fill_ns, now_ns() - t0);
+	if (data->clock_on) read_clock(data);
+	return done;
+}
+
+
+/** Write up to one period of samples from src.
+ * Returns the number of frames written, which is 0 if we had to start or wait
+ * for the pcm instead, or a negative error code. In deadline mode, returns
+ * -EAGAIN once we're out of time for this iteration.
+ */
+static snd_pcm_sframes_t process_period(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t size
+){
+	int err;
+	if (data->budget_us && now_ns() >= data->deadline_ns)
+		return -EAGAIN;
+	if (UNLIKELY(atomic_load_explicit(&data->reconf_pending,
+		memory_order_acquire
+	))) {
+		apply_pending(data);
+	}
+	if (data->adapt) adapt_period(data);
+	// only pay for timestamps if someone's reading the stats
+	long long t0 = 0;
+	if (data->stats_block) {
+		t0 = now_ns();
+		if (t0 >= data->stats_next_ns) {
+			data->stats.drops = atomic_load_explicit(
+				&data->ring_drops, memory_order_relaxed
+			);
+			aylp_alsa_stats_publish(data->stats_block,
+				&data->stats, t0
+			);
+			data->stats_next_ns = t0
+				+ data->stats_interval_ms * 1000000LL;
+		}
+	}
+	// offline, there's never anything to wait for or recover from
+	if (data->render_path) return put_frames(data, src, size);
+	// check for xrun and suspend events
+	snd_pcm_state_t pcm_state = snd_pcm_state(data->handle);
+	if (UNLIKELY(pcm_state == SND_PCM_STATE_XRUN
+	|| pcm_state == SND_PCM_STATE_SUSPENDED)) {
+		err = recover(data, pcm_state == SND_PCM_STATE_XRUN
+			? -EPIPE : -ESTRPIPE
+		);
+		if (err) return err;
+	} else if (UNLIKELY(pcm_state == SND_PCM_STATE_PREPARED
+	&& data->started && !data->needs_start)) {
+		// something we're linked to (a capture or another card)
+		// recovered and prepared us, so start again once we're full
+		data->needs_start = true;
+	}
+
+	// make sure we have room for what we're writing
+	snd_pcm_uframes_t avail = snd_pcm_avail_update(data->handle);
+	if (LIKELY((snd_pcm_sframes_t)avail >= 0))
+		avail = check_underrun(data, avail);
+	if (UNLIKELY((snd_pcm_sframes_t)avail < 0)) {
+		log_warn("Failed to check availability: %s",
+			snd_strerror(avail)
+		);
+		err = recover(data, avail);
+		return err ? err : 0;
+	}
+	if (data->stats_block) {
+		aylp_alsa_hist_add(&data->stats.avail, avail);
+		snd_pcm_sframes_t delay;
+		if (!snd_pcm_delay(data->handle, &delay) && delay > 0)
+			aylp_alsa_hist_add(&data->stats.delay, delay);
+	}
+	if (data->budget_us && data->not_ready == AYLP_ALSA_PARTIAL
+	&& !data->needs_start && avail > 0 && avail < size) {
+		// settle for whatever room there is
+		size = avail;
+	}
+	if (UNLIKELY(avail < size)) {
+		if (data->stats_block) t0 = now_ns();
+		if (data->needs_start) {
+			log_trace("Starting pcm");
+			err = start_pcm(data);
+			// wait for the rest of the group to fill up
+			if (err == -EAGAIN) return err;
+			data->needs_start = false;
+			if (data->started) data->stats.restarts++;
+			data->started = true;
+			if (err < 0) {
+				log_error("Start error: %s", snd_strerror(err));
+				return err;
+			}
+		} else if (data->budget_us
+		&& data->not_ready != AYLP_ALSA_HOLD) {
+			return -EAGAIN;
+		} else {
+			err = wait_room(data, size);
+			count_wait(data, t0);
+			// outside of deadline mode, a timeout is just a retry
+			if (err == -EAGAIN) return data->budget_us ? err : 0;
+			if (err < 0) {
+				log_warn("Wait error: %s", snd_strerror(err));
+				err = recover(data, err);
+				return err ? err : 0;
+			}
+		}
+		return 0;
+		// Instead of return 0 above, we could put this whole thing in a
+		// loop and simply `continue`. Depends on if we want to wait for
+		// ALSA to be ready to take our data or if we just want to get
+		// on with the loop.
+	}
+
+	return put_frames(data, src, size);
+}
+
+
+/** Makes m (channels x frames) the wavetable we loop, tiled to at least a
+ * period so that no period needs more than two copies, unless it's the table
+ * we're looping already. The buffers are sized at init and only grow if a
+ * longer table comes along, so a pipeline that keeps sending tables of the
+ * same size doesn't allocate. Returns 0 or -1.
+ */
+static int set_table(struct aylp_alsa_data *data, const gsl_matrix *m)
+{
+	if (m->size1 != data->channels) {
+		log_error("Wavetable has %zu rows but we have %u channels",
+			m->size1, data->channels
+		);
+		return -1;
+	}
+	size_t len = m->size2;
+	if (data->wt && len == data->wt_len) {
+		// compare bits, like encode_hold()
+		bool same = true;
+		for (unsigned c = 0; c < data->channels && same; c++) {
+			same = !memcmp(data->wt->data + c * data->wt->tda,
+				m->data + c * m->tda, len * sizeof(double)
+			);
+		}
+		if (same) return 0;
+	}
+	size_t n = (data->period_size + len - 1) / len * len;
+	if (n > data->wt_cap) {
+		if (data->wt) gsl_matrix_free(data->wt);
+		data->wt = gsl_matrix_alloc(data->channels, n);
+		xfree(data->wt_scaled);
+		data->wt_scaled = xcalloc(data->channels * n, sizeof(double));
+		free(data->wt_enc);	// from aligned_alloc()
+		data->wt_enc = aligned_alloc(64,
+			(n * data->channels * data->phys_bps + 63) & ~(size_t)63
+		);
+		if (!data->wt_enc) {
+			log_error("Couldn't allocate encoded wavetable");
+			return -1;
+		}
+		data->wt_cap = n;
+	}
+	for (unsigned c = 0; c < data->channels; c++) {
+		double *row = data->wt->data + c * data->wt->tda;
+		for (size_t f = 0; f < n; f++)
+			row[f] = gsl_matrix_get(m, c, f % len);
+	}
+	if (len != data->wt_len)
+		log_info("Looping a %zu-frame wavetable", len);
+	data->wt_frames = n;
+	data->wt_len = len;
+	data->wt_pos = 0;
+	data->wt_ok = false;
+	return 0;
+}
+
+
+/** Applies each channel's gain and offset from x to the wavetable and encodes
+ * the result, unless they're the ones we encoded with last time.
+ */
+static void encode_table(struct aylp_alsa_data *data, const double *x,
+	size_t stride
+){
+	bool same = data->wt_ok;
+	for (unsigned i = 0; i < 2 * data->channels; i++) {
+		double v = x[i * stride];
+		// compare bits, like encode_hold()
+		if (memcmp(&v, &data->wt_params[i], sizeof v)) {
+			data->wt_params[i] = v;
+			same = false;
+		}
+	}
+	if (same) return;
+	size_t n = data->wt_frames;
+	size_t bps = data->phys_bps;
+	size_t frame_bytes = data->channels * bps;
+	for (unsigned c = 0; c < data->channels; c++) {
+		double gain = data->wt_params[2*c];
+		double offset = data->wt_params[2*c + 1];
+		const double *in = data->wt->data + c * data->wt->tda;
+		double *out = data->wt_scaled + c * n;
+		for (size_t f = 0; f < n; f++) out[f] = offset + gain * in[f];
+		if (data->planar) {
+			data->conv(data->wt_enc + c * n * bps, bps, out, 1, n);
+		} else {
+			data->conv(data->wt_enc + c * bps, frame_bytes, out,
+				1, n
+			);
+		}
+	}
+	data->wt_ok = true;
+}
+
+
+/** process_period() for held input: in synth mode, the frames come from the
+ * oscillators instead of src, and only the frames that were written advance
+ * them. In wavetable mode, they come from the encoded table, and only the
+ * frames that were written advance the play position.
+ */
+static snd_pcm_sframes_t write_period(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, snd_pcm_uframes_t size
+){
+	if (data->wt_on) {
+		size_t n = data->wt_frames;
+		// the fallback conversion can't wrap around the table
+		if (size > n - data->wt_pos) size = n - data->wt_pos;
+		const struct aylp_alsa_src table = {
+			.data = data->wt_scaled + data->wt_pos,
+			.ch_stride = n,
+			.frame_stride = 1,
+			.enc = data->wt_enc,
+			.enc_frames = n,
+			.enc_pos = data->wt_pos,
+		};
+		snd_pcm_sframes_t done = process_period(data, &table, size);
+		if (done > 0) data->wt_pos = (data->wt_pos + done) % n;
+		return done;
+	}
+	if (!data->synth_on) return process_period(data, src, size);
+	if (size > data->synth.max_frames) size = data->synth.max_frames;
+	aylp_alsa_synth_run(&data->synth, size);
+	snd_pcm_sframes_t done = process_period(data, &data->synth_src, size);
+	if (done > 0) aylp_alsa_synth_advance(&data->synth, done);
+	return done;
+}
+
+
+/** Blocks (per wakeup) until the card has room for frames past the target
+ * delay (if any), or the whole buffer if that's less. Returns 0 once there's
+ * room (or we've recovered), -EAGAIN if we ran out of time, or a negative
+ * error code.
+ */
+static int wait_queue(struct aylp_alsa_data *data, snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t room = pace_room(data, frames);
+	if (room > data->buffer_size) room = data->buffer_size;
+	long long t0 = data->stats_block ? now_ns() : 0;
+	int err = 0;
+	for (;;) {
+		// hwsync, so we don't sleep on a stale hw pointer
+		snd_pcm_sframes_t avail = snd_pcm_avail(data->handle);
+		if (LIKELY(avail >= 0)) avail = check_underrun(data, avail);
+		if (UNLIKELY(avail < 0)) return recover(data, avail);
+		if ((snd_pcm_uframes_t)avail >= room) break;
+		err = wait_room(data, room);
+		if (err == -EAGAIN) break;
+		if (UNLIKELY(err < 0)) return recover(data, err);
+	}
+	count_wait(data, t0);
+	return err == -EAGAIN ? err : 0;
+}
+
+
+/** Starts the pcm once queued frames reach target_delay, since the buffer
+ * never fills in that mode. Returns 0 (also if it's not time yet, or the rest
+ * of the group will start us) or a negative error code.
+ */
+static int start_at_target(struct aylp_alsa_data *data,
+	snd_pcm_sframes_t queued
+){
+	if (!data->needs_start
+	|| queued < (snd_pcm_sframes_t)data->target_delay) {
+		return 0;
+	}
+	int err = start_pcm(data);
+	// the rest of the group will start us once they're full
+	if (err == -EAGAIN) return 0;
+	if (err < 0) {
+		log_error("Start error: %s", snd_strerror(err));
+		return err;
+	}
+	data->needs_start = false;
+	if (data->started) data->stats.restarts++;
+	data->started = true;
+	return 0;
+}
+
+
+/** Write frames from src, waiting on the pcm as needed. They go a period at a
+ * time, or with pace or target_delay, in chunks of pace frames (or a period)
+ * that each wait until they fit past the target delay, so blocks and
+ * interpolated runs keep to the same pace and queue depth as held vectors.
+ * In deadline mode, whatever doesn't fit before the deadline is dropped.
+ */
+static int write_frames(struct aylp_alsa_data *data,
+	struct aylp_alsa_src src, snd_pcm_uframes_t frames
+){
+	bool paced = (data->pace || data->target_delay) && !data->render_path;
+	snd_pcm_uframes_t chunk = data->pace ? data->pace : data->period_size;
+	while (frames > 0
+	&& !atomic_load_explicit(&data->stop, memory_order_relaxed)) {
+		snd_pcm_uframes_t size = frames < chunk ? frames : chunk;
+		// until the pcm is running, fill it the usual way
+		if (paced && !data->needs_start) {
+			int err = wait_queue(data, size);
+			if (err == -EAGAIN) return 0;	// out of time
+			if (UNLIKELY(err < 0)) return err;
+		}
+		snd_pcm_sframes_t done = process_period(data, &src, size);
+		if (done == -EAGAIN) return 0;	// out of time
+		if (done < 0) return done;
+		src.data += done * src.frame_stride;
+		frames -= done;
+		snd_pcm_sframes_t delay;
+		if (paced && data->target_delay && data->needs_start
+		&& !snd_pcm_delay(data->handle, &delay)) {
+			int err = start_at_target(data, delay);
+			if (UNLIKELY(err < 0)) return err;
+		}
+	}
+	return 0;
+}
+
+
+/** Writes just enough of src's held frame (or synth output) to bring the
+ * queue back up to target_delay frames, and starts the pcm once it's there.
+ * Returns the number of frames written or a negative error code.
+ */
+static snd_pcm_sframes_t top_up(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src
+){
+	// hwsync, so this is where the card is now, not as of the last irq
+	snd_pcm_sframes_t delay;
+	int err = snd_pcm_delay(data->handle, &delay);
+	if (UNLIKELY(err < 0)) {
+		// recover() refills to target_delay and restarts
+		return recover(data, err);
+	}
+	if (delay < 0) {
+		// the card has played past what we wrote
+		snd_pcm_sframes_t avail = check_underrun(data,
+			data->buffer_size - delay
+		);
+		if (UNLIKELY(avail < 0)) return recover(data, avail);
+		delay = 0;
+	}
+	snd_pcm_sframes_t target = data->target_delay;
+	snd_pcm_sframes_t written = 0;
+	while (delay + written < target) {
+		snd_pcm_uframes_t want = target - delay - written;
+		if (want > data->period_size) want = data->period_size;
+		snd_pcm_sframes_t done = write_period(data, src, want);
+		if (done < 0) return done;
+		if (done == 0) break;	// recovered; measure again next time
+		written += done;
+	}
+	err = start_at_target(data, delay + written);
+	return err < 0 ? err : written;
+}
+
+
+/** Write a whole channels x frames block, waiting on the pcm as needed. */
+static int process_block(struct aylp_alsa_data *data, const gsl_matrix *block)
+{
+	// each row is one channel, so frames are contiguous
+	struct aylp_alsa_src src = {
+		.data = block->data,
+		.ch_stride = block->tda,
+		.frame_stride = 1,
+	};
+	return write_frames(data, src, block->size2);
+}
+
+
+/** Touches the whole mmap buffer (writing silence) so the first periods don't
+ * take page faults. Only valid before the pcm is started.
+ */
+static void prefault_mmap(struct aylp_alsa_data *data)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames = data->buffer_size;
+	int err = snd_pcm_mmap_begin(data->handle, &areas, &offset, &frames);
+	if (err < 0) {
+		log_warn("Couldn't prefault mmap area: %s", snd_strerror(err));
+		return;
+	}
+	snd_pcm_areas_silence(areas, offset, data->channels, frames,
+		data->format
+	);
+	// we don't want to queue anything yet, so commit nothing
+	snd_pcm_mmap_commit(data->handle, offset, 0);
+	log_info("Prefaulted %lu frames of mmap area", frames);
+}
+
+
+/** Touches everything the write path uses so it doesn't fault later. */
+static void prefault_buffers(struct aylp_alsa_data *data)
+{
+	if (!data->rw && !data->render_path) prefault_mmap(data);
+	aylp_alsa_rt_prefault(data->samples,
+		data->channels * data->plane_bytes
+	);
+	aylp_alsa_rt_prefault(data->last, data->channels * sizeof(double));
+	aylp_alsa_rt_prefault(data->pattern, data->pattern_frames
+		* data->channels * data->phys_bps
+	);
+	aylp_alsa_rt_prefault(data->hold, data->channels * sizeof(double));
+	if (data->ring.buf) {
+		aylp_alsa_rt_prefault(data->ring.buf, data->ring.n_slots
+			* data->channels * data->ring.cap_frames
+			* sizeof(double)
+		);
+	}
+	if (data->interp.out) {
+		aylp_alsa_rt_prefault(data->interp.out, data->interp.frames
+			* data->channels * sizeof(double)
+		);
+		aylp_alsa_rt_prefault(data->interp.coefs, data->interp.frames
+			* data->interp.taps * sizeof(double)
+		);
+	}
+}
+
+
+/** Applies scheduling and pinning to the calling thread, which is the one
+ * that does our pcm writes.
+ */
+static void apply_rt(struct aylp_alsa_data *data)
+{
+	if (data->rt.policy != SCHED_OTHER || data->rt.cpus)
+		aylp_alsa_rt_apply(&data->rt);
+	if (data->rt.prefault) aylp_alsa_rt_prefault_stack();
+}
+
+
+/** Writes one block from the ring, then holds its last frame. */
+static void write_slot(struct aylp_alsa_data *data,
+	const struct aylp_alsa_slot *slot
+){
+	size_t cap = data->ring.cap_frames;
+	struct aylp_alsa_src src = {
+		.data = slot->data,
+		.ch_stride = cap,
+		.frame_stride = 1,
+	};
+	// on error, the rest of the block is dropped
+	write_frames(data, src, slot->frames);
+	if (slot->frames > 0) {
+		for (unsigned c = 0; c < data->channels; c++)
+			data->hold[c] = slot->data[c*cap + slot->frames - 1];
+	}
+}
+
+
+/** Takes the newest held vector from the mailbox once the blocks pushed
+ * before it have been written, unless a block was pushed after it, in which
+ * case the block's last frame is newer. Returns true if the value we hold
+ * changed.
+ */
+static bool take_mailbox(struct aylp_alsa_data *data)
+{
+	size_t seen = data->mailbox_seen;
+	size_t after;
+	if (!aylp_alsa_mailbox_get(&data->mailbox, &seen, data->mail, &after))
+		return false;
+	size_t tail = atomic_load_explicit(&data->ring.tail,
+		memory_order_relaxed
+	);
+	// blocks before it still queued; come back for it
+	if ((ptrdiff_t)(tail - after) < 0) return false;
+	data->mailbox_seen = seen;
+	if (tail != after) return false;
+	memcpy(data->hold, data->mail, data->channels * sizeof(double));
+	return true;
+}
+
+
+/** Writer thread: drains the ring into the pcm.
+ * Between blocks, we keep the card fed with the last value we were given.
+ */
+static void *writer_thread(void *arg)
+{
+	struct aylp_alsa_data *data = arg;
+	struct aylp_alsa_ring *ring = &data->ring;
+	const struct aylp_alsa_src hold = {
+		.data = data->hold,
+		.ch_stride = 1,
+		.frame_stride = 0,
+	};
+	apply_rt(data);
+	while (!atomic_load_explicit(&data->stop, memory_order_relaxed)) {
+		struct aylp_alsa_slot *slot = aylp_alsa_ring_peek(ring);
+		if (!slot && take_mailbox(data)) {
+			// got a newer value to hold; write it next time round
+		} else if (!slot && data->target_delay) {
+			snd_pcm_sframes_t err = top_up(data, &hold);
+			if (UNLIKELY(err < 0)) {
+				struct timespec ts = {.tv_nsec = 1000000};
+				nanosleep(&ts, NULL);
+			} else if (!err) {
+				// nothing to do until a quarter of the queue
+				// has played out
+				long long ns = data->target_delay
+					* 250000000LL / data->rate;
+				struct timespec ts = {
+					.tv_sec = ns / 1000000000LL,
+					.tv_nsec = ns % 1000000000LL,
+				};
+				nanosleep(&ts, NULL);
+			}
+		} else if (!slot) {
+			snd_pcm_sframes_t err = process_period(data, &hold,
+				data->period_size
+			);
+			if (UNLIKELY(err < 0)) {
+				// don't spin on a broken pcm
+				struct timespec ts = {.tv_nsec = 1000000};
+				nanosleep(&ts, NULL);
+			}
+		} else {
+			write_slot(data, slot);
+			aylp_alsa_ring_pop(ring);
+		}
+	}
+	return NULL;
+}
+
+
+/** Pushes frames from src into the ring as blocks for the writer thread.
+ * If the ring is full, what doesn't fit is dropped and counted.
+ */
+static void push_frames(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src, size_t frames
+){
+	struct aylp_alsa_ring *ring = &data->ring;
+	size_t cap = ring->cap_frames;
+	for (size_t f = 0; f < frames; f += cap) {
+		struct aylp_alsa_slot *slot = aylp_alsa_ring_claim(ring);
+		if (UNLIKELY(!slot)) {
+			atomic_fetch_add_explicit(&data->ring_drops,
+				frames - f, memory_order_relaxed
+			);
+			return;
+		}
+		size_t n = frames - f < cap ? frames - f : cap;
+		for (unsigned c = 0; c < data->channels; c++) {
+			const double *in = src->data + c * src->ch_stride
+				+ f * src->frame_stride;
+			double *out = slot->data + c * cap;
+			if (src->frame_stride == 1) {
+				memcpy(out, in, n * sizeof(double));
+			} else {
+				for (size_t i = 0; i < n; i++)
+					out[i] = in[i * src->frame_stride];
+			}
+		}
+		slot->frames = n;
+		aylp_alsa_ring_push(ring);
+	}
+}
+
+
+/** Hands a vector or block to the writer thread.
+ * Exactly one of vec and block is non-NULL. Blocks and interpolated runs go
+ * through the ring, and what doesn't fit is dropped; a held vector goes in
+ * the mailbox, replacing any older one the writer hasn't taken yet.
+ */
+static int push_input(struct aylp_alsa_data *data, const gsl_vector *vec,
+	const gsl_matrix *block
+){
+	struct aylp_alsa_ring *ring = &data->ring;
+	if (block) {
+		struct aylp_alsa_src src = {
+			.data = block->data,
+			.ch_stride = block->tda,
+			.frame_stride = 1,
+		};
+		push_frames(data, &src, block->size2);
+		return 0;
+	}
+	if (data->interp.kind != AYLP_ALSA_INTERP_NONE) {
+		aylp_alsa_interp_run(&data->interp, vec->data, vec->stride);
+		push_frames(data, &data->interp_src, data->interp.frames);
+		return 0;
+	}
+	// the newest value wins, however far behind the writer thread is
+	aylp_alsa_mailbox_put(&data->mailbox, ring, vec->data, vec->stride);
+	return 0;
+}
+
+
+/** Pipeline vector elements we take: one per channel, or the oscillator or
+ * wavetable parameters for each channel. With devices, it's the sum of what
+ * each card takes, since fan_out() splits the vector that way.
+ */
+static size_t input_width(const struct aylp_alsa_data *data)
+{
+	if (data->n_cards) {
+		size_t width = 0;
+		for (unsigned k = 0; k < data->n_cards; k++)
+			width += input_width(&data->cards[k]);
+		return width;
+	}
+	if (data->synth_on) return AYLP_ALSA_SYNTH_PARAMS * data->channels;
+	// gain and offset
+	if (data->wt_on) return 2 * data->channels;
+	return data->channels;
+}
+
+
+/** Maps the pipeline's vector or matrix onto our channels.
+ * With a routing matrix, this is one gemv (or gemm for a block) into our own
+ * buffers. Without one, the input must already have a row per channel. On
+ * success, sets exactly one of *vec and *block.
+ */
+static int route_input(struct aylp_alsa_data *data, struct aylp_state *state,
+	gsl_vector **vec, gsl_matrix **block
+){
+	gsl_matrix *r = data->routing;
+	*vec = NULL;
+	*block = NULL;
+	if (state->header.type == AYLP_T_MATRIX) {
+		gsl_matrix *in = state->matrix;
+		size_t rows = r ? r->size2 : data->channels;
+		if (UNLIKELY(in->size1 != rows)) {
+			log_error("Pipeline matrix has %zu rows but we need "
+				"%zu", in->size1, rows
+			);
+			return -1;
+		}
+		if (!r) {
+			*block = in;
+			return 0;
+		}
+		if (!data->routed_block
+		|| data->routed_block->size2 != in->size2) {
+			if (data->routed_block)
+				gsl_matrix_free(data->routed_block);
+			data->routed_block = gsl_matrix_alloc(data->channels,
+				in->size2
+			);
+		}
+		gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, r, in,
+			0.0, data->routed_block
+		);
+		*block = data->routed_block;
+		return 0;
+	}
+	gsl_vector *in = state->vector;
+	if (r) {
+		if (UNLIKELY(in->size != r->size2)) {
+			log_error("Pipeline vector is size %zu but routing has "
+				"%zu inputs", in->size, r->size2
+			);
+			return -1;
+		}
+		gsl_blas_dgemv(CblasNoTrans, 1.0, r, in, 0.0, data->routed);
+		*vec = data->routed;
+		return 0;
+	}
+	size_t width = input_width(data);
+	if (UNLIKELY(in->size < width)) {
+		log_error("Pipeline vector is size %zu but we need %zu",
+			in->size, width
+		);
+		return -1;
+	}
+	if (UNLIKELY(in->size > width && !data->warned_size)) {
+		log_warn("Pipeline vector is size %zu but we need %zu; "
+			"ignoring the rest", in->size, width
+		);
+		data->warned_size = true;
+	}
+	*vec = in;
+	return 0;
+}
+
+
+/** Parses a JSON array of equal-length arrays of numbers into a matrix.
+ * Returns NULL if it's malformed.
+ */
+static gsl_matrix *parse_matrix(json_object *val)
+{
+	if (!json_object_is_type(val, json_type_array)) return NULL;
+	size_t rows = json_object_array_length(val);
+	if (!rows) return NULL;
+	json_object *row = json_object_array_get_idx(val, 0);
+	if (!json_object_is_type(row, json_type_array)) return NULL;
+	size_t cols = json_object_array_length(row);
+	if (!cols) return NULL;
+	gsl_matrix *m = gsl_matrix_alloc(rows, cols);
+	for (size_t i = 0; i < rows; i++) {
+		row = json_object_array_get_idx(val, i);
+		if (!json_object_is_type(row, json_type_array)
+		|| json_object_array_length(row) != cols) {
+			gsl_matrix_free(m);
+			return NULL;
+		}
+		for (size_t j = 0; j < cols; j++) {
+			gsl_matrix_set(m, i, j, json_object_get_double(
+				json_object_array_get_idx(row, j)
+			));
+		}
+	}
+	return m;
+}
+
+
+/** Parses the params json into our data struct. */
+static int parse_params(struct aylp_alsa_data *data, json_object *params)
+{
+	json_object_object_foreach(params, key, val) {
 		if (key[0] == '_') {
 			// keys starting with _ are comments
-		} else if (!strcmp(key, "?")) {
-			// ?
+		} else if (!strcmp(key, "device")) {
+			data->device = (char *)json_object_get_string(val);
+			log_trace("device = %s", data->device);
+		} else if (!strcmp(key, "access")) {
+			const char *s = json_object_get_string(val);
+			if (parse_access(s, &data->access)) {
+				log_error("Unknown access \"%s\"", s);
+				return -1;
+			}
+			log_trace("access = %s",
+				snd_pcm_access_name(data->access)
+			);
+		} else if (!strcmp(key, "format")) {
+			const char *s = json_object_get_string(val);
+			data->format = snd_pcm_format_value(s);
+			if (data->format == SND_PCM_FORMAT_UNKNOWN) {
+				log_error("Unknown format \"%s\"", s);
+				return -1;
+			}
+			log_trace("format = %s",
+				snd_pcm_format_name(data->format)
+			);
+		} else if (!strcmp(key, "channels")) {
+			data->channels = json_object_get_int(val);
+			log_trace("channels = %u", data->channels);
+		} else if (!strcmp(key, "rate")) {
+			data->rate = json_object_get_int(val);
+			log_trace("rate = %u", data->rate);
+		} else if (!strcmp(key, "buffer_time")) {
+			data->buffer_time = json_object_get_int(val);
+			log_trace("buffer_time = %u", data->buffer_time);
+		} else if (!strcmp(key, "period_time")) {
+			data->period_time = json_object_get_int(val);
+			log_trace("period_time = %u", data->period_time);
+		} else if (!strcmp(key, "latency_target_us")) {
+			data->latency_target_us = json_object_get_int(val);
+			log_trace("latency_target_us = %u",
+				data->latency_target_us
+			);
+		} else if (!strcmp(key, "budget_us")) {
+			data->budget_us = json_object_get_int(val);
+			log_trace("budget_us = %u", data->budget_us);
+		} else if (!strcmp(key, "writer_thread")) {
+			data->writer_thread = json_object_get_boolean(val);
+			log_trace("writer_thread = %d", data->writer_thread);
+		} else if (!strcmp(key, "ring_slots")) {
+			data->ring_slots = json_object_get_int(val);
+			log_trace("ring_slots = %u", data->ring_slots);
+		} else if (!strcmp(key, "interp")) {
+			const char *s = json_object_get_string(val);
+			if (!s) s = "";
+			if (!strcmp(s, "none")) {
+				data->interp.kind = AYLP_ALSA_INTERP_NONE;
+			} else if (!strcmp(s, "linear")) {
+				data->interp.kind = AYLP_ALSA_INTERP_LINEAR;
+			} else if (!strcmp(s, "cubic")) {
+				data->interp.kind = AYLP_ALSA_INTERP_CUBIC;
+			} else if (!strcmp(s, "sinc")) {
+				data->interp.kind = AYLP_ALSA_INTERP_SINC;
+			} else {
+				log_error("Unknown interp \"%s\"", s);
+				return -1;
+			}
+			log_trace("interp = %s", s);
+		} else if (!strcmp(key, "interp_frames")) {
+			data->interp_frames = json_object_get_int(val);
+			log_trace("interp_frames = %zu", data->interp_frames);
+		} else if (!strcmp(key, "profile")) {
+			data->profile_path = json_object_get_string(val);
+			log_trace("profile = %s", data->profile_path);
+		} else if (!strcmp(key, "probe")) {
+			data->probe = json_object_get_boolean(val);
+			log_trace("probe = %d", data->probe);
+		} else if (!strcmp(key, "probe_ms")) {
+			data->probe_ms = json_object_get_int(val);
+			log_trace("probe_ms = %u", data->probe_ms);
+		} else if (!strcmp(key, "adapt")) {
+			data->adapt = json_object_get_boolean(val);
+			log_trace("adapt = %d", data->adapt);
+		} else if (!strcmp(key, "adapt_interval_ms")) {
+			data->adapt_interval_ms = json_object_get_int(val);
+			log_trace("adapt_interval_ms = %u",
+				data->adapt_interval_ms
+			);
+		} else if (!strcmp(key, "adapt_min_period")) {
+			data->adapt_min_period = json_object_get_int(val);
+			log_trace("adapt_min_period = %lu",
+				data->adapt_min_period
+			);
+		} else if (!strcmp(key, "adapt_max_period")) {
+			data->adapt_max_period = json_object_get_int(val);
+			log_trace("adapt_max_period = %lu",
+				data->adapt_max_period
+			);
+		} else if (!strcmp(key, "wavetable")) {
+			// inline, or a path to a JSON file holding one
+			json_object *file = NULL;
+			if (json_object_is_type(val, json_type_string)) {
+				file = json_object_from_file(
+					json_object_get_string(val)
+				);
+				val = file;
+			}
+			if (data->wt_init) gsl_matrix_free(data->wt_init);
+			data->wt_init = val ? parse_matrix(val) : NULL;
+			if (file) json_object_put(file);
+			if (!data->wt_init) {
+				log_error("wavetable must be an array of "
+					"equal-length arrays of samples, or a "
+					"JSON file holding one"
+				);
+				return -1;
+			}
+			log_trace("wavetable = %zu x %zu",
+				data->wt_init->size1, data->wt_init->size2
+			);
+		} else if (!strcmp(key, "wavetable_input")) {
+			data->wt_input = json_object_get_boolean(val);
+			log_trace("wavetable_input = %d", data->wt_input);
+		} else if (!strcmp(key, "direct")) {
+			const char *s = json_object_get_string(val);
+			if (!s) s = "";
+			if (!strcmp(s, "off")) {
+				data->direct = AYLP_ALSA_DIRECT_OFF;
+			} else if (!strcmp(s, "warn")) {
+				data->direct = AYLP_ALSA_DIRECT_WARN;
+			} else if (!strcmp(s, "require")) {
+				data->direct = AYLP_ALSA_DIRECT_REQUIRE;
+			} else {
+				log_error("Unknown direct mode \"%s\"", s);
+				return -1;
+			}
+			log_trace("direct = %s", s);
+		} else if (!strcmp(key, "synth")) {
+			data->synth_on = json_object_get_boolean(val);
+			log_trace("synth = %d", data->synth_on);
+		} else if (!strcmp(key, "target_delay")) {
+			data->target_delay = json_object_get_int(val);
+			log_trace("target_delay = %lu", data->target_delay);
+		} else if (!strcmp(key, "pace")) {
+			int pace = json_object_get_int(val);
+			if (pace <= 0) {
+				log_error("pace must be a positive number of "
+					"frames"
+				);
+				return -1;
+			}
+			data->pace = pace;
+			log_trace("pace = %lu", data->pace);
+		} else if (!strcmp(key, "render")) {
+			data->render_path = json_object_get_string(val);
+			log_trace("render = %s", data->render_path);
+		} else if (!strcmp(key, "render_ring")) {
+			data->render_ring = json_object_get_int(val);
+			log_trace("render_ring = %zu", data->render_ring);
+		} else if (!strcmp(key, "interp_taps")) {
+			data->interp_taps = json_object_get_int(val);
+			log_trace("interp_taps = %u", data->interp_taps);
+		} else if (!strcmp(key, "stats_path")) {
+			data->stats_path = json_object_get_string(val);
+			log_trace("stats_path = %s", data->stats_path);
+		} else if (!strcmp(key, "stats_interval_ms")) {
+			data->stats_interval_ms = json_object_get_int(val);
+			log_trace("stats_interval_ms = %u",
+				data->stats_interval_ms
+			);
+		} else if (!strcmp(key, "devices")) {
+			if (!json_object_is_type(val, json_type_array)) {
+				log_error("devices must be an array of "
+					"objects"
+				);
+				return -1;
+			}
+			data->devices = val;
+			log_trace("devices = %zu cards",
+				json_object_array_length(val)
+			);
+		} else if (!strcmp(key, "routing")) {
+			if (data->routing) gsl_matrix_free(data->routing);
+			data->routing = parse_matrix(val);
+			if (!data->routing) {
+				log_error("routing must be an array of "
+					"equal-length arrays of gains"
+				);
+				return -1;
+			}
+			log_trace("routing = %zu x %zu",
+				data->routing->size1, data->routing->size2
+			);
+		} else if (!strcmp(key, "sched")) {
+			const char *s = json_object_get_string(val);
+			if (aylp_alsa_rt_parse_policy(s, &data->rt.policy)) {
+				log_error("Unknown sched policy \"%s\"", s);
+				return -1;
+			}
+			log_trace("sched = %s", s);
+		} else if (!strcmp(key, "sched_priority")) {
+			data->rt.priority = json_object_get_int(val);
+			log_trace("sched_priority = %d", data->rt.priority);
+		} else if (!strcmp(key, "mlock")) {
+			data->rt.mlock = json_object_get_boolean(val);
+			log_trace("mlock = %d", data->rt.mlock);
+		} else if (!strcmp(key, "cpu_affinity")) {
+			if (!json_object_is_type(val, json_type_array)
+			|| !json_object_array_length(val)) {
+				log_error("cpu_affinity must be an array "
+					"of CPU numbers"
+				);
+				return -1;
+			}
+			aylp_alsa_rt_free(&data->rt);
+			data->rt.n_cpus = json_object_array_length(val);
+			data->rt.cpus = xcalloc(data->rt.n_cpus,
+				sizeof(unsigned)
+			);
+			for (unsigned i = 0; i < data->rt.n_cpus; i++) {
+				data->rt.cpus[i] = json_object_get_int(
+					json_object_array_get_idx(val, i)
+				);
+			}
+			log_trace("cpu_affinity = %u CPUs", data->rt.n_cpus);
+		} else if (!strcmp(key, "prefault")) {
+			data->rt.prefault = json_object_get_boolean(val);
+			log_trace("prefault = %d", data->rt.prefault);
+		} else if (!strcmp(key, "clock")) {
+			data->clock_on = json_object_get_boolean(val);
+			log_trace("clock = %d", data->clock_on);
+		} else if (!strcmp(key, "clock_output")) {
+			data->clock_output = json_object_get_boolean(val);
+			log_trace("clock_output = %d", data->clock_output);
+		} else if (!strcmp(key, "clock_interval_ms")) {
+			data->clock_interval_ms = json_object_get_int(val);
+			log_trace("clock_interval_ms = %u",
+				data->clock_interval_ms
+			);
+		} else if (!strcmp(key, "wakeup")) {
+			const char *s = json_object_get_string(val);
+			if (!s) s = "";
+			if (!strcmp(s, "irq")) {
+				data->wakeup = AYLP_ALSA_WAKE_IRQ;
+			} else if (!strcmp(s, "timer")) {
+				data->wakeup = AYLP_ALSA_WAKE_TIMER;
+			} else if (!strcmp(s, "busy")) {
+				data->wakeup = AYLP_ALSA_WAKE_BUSY;
+			} else {
+				log_error("Unknown wakeup \"%s\"", s);
+				return -1;
+			}
+			log_trace("wakeup = %s", s);
+		} else if (!strcmp(key, "not_ready")) {
+			const char *s = json_object_get_string(val);
+			if (!s) s = "";
+			if (!strcmp(s, "skip")) {
+				data->not_ready = AYLP_ALSA_SKIP;
+			} else if (!strcmp(s, "partial")) {
+				data->not_ready = AYLP_ALSA_PARTIAL;
+			} else if (!strcmp(s, "hold")) {
+				data->not_ready = AYLP_ALSA_HOLD;
+			} else {
+				log_error("Unknown not_ready policy \"%s\"", s);
+				return -1;
+			}
+			log_trace("not_ready = %s", s);
 		} else {
 			log_warn("Unknown parameter \"%s\"", key);
 		}
 	}
-	// enforce required params
-	if (! ?) {
-		log_error("You must provide at least the ? param.");
+	data->wt_on = data->wt_init || data->wt_input;
+	return 0;
+}
+
+
+/** Logs the chain of PCMs between us and the DMA buffer, from the headers of
+ * snd_pcm_dump(), and counts the layers in it that convert or copy samples.
+ * In direct mode, those are a warning, or an error if direct is "require".
+ * Returns 0 or -1.
+ */
+static int check_path(struct aylp_alsa_data *data)
+{
+	static const char *const copiers[] = {
+		"conversion PCM", "Soft volume PCM", "Direct Stream Mixing PCM",
+		"Direct Sharing PCM", "Copy PCM", "Mu-Law", "A-Law",
+		"IMA-ADPCM", "LADSPA", "Plugin PCM",
+	};
+	snd_output_t *out;
+	if (snd_output_buffer_open(&out) < 0) return 0;
+	snd_pcm_dump(data->handle, out);
+	char *text;
+	size_t len = snd_output_buffer_string(out, &text);
+
+	// the first line, then each "Slave: " line, is one layer
+	char path[512];
+	size_t n = 0;
+	unsigned layers = 0, copies = 0;
+	path[0] = '\0';
+	for (size_t i = 0; i < len; ) {
+		size_t end = i;
+		while (end < len && text[end] != '\n') end++;
+		const char *line = text + i;
+		size_t line_len = end - i;
+		bool header = i == 0;
+		if (line_len > 7 && !strncmp(line, "Slave: ", 7)) {
+			line += 7;
+			line_len -= 7;
+			header = true;
+		}
+		i = end + 1;
+		if (!header || !line_len) continue;
+		// the dump isn't nul-terminated
+		char hdr[256];
+		snprintf(hdr, sizeof hdr, "%.*s", (int)line_len, line);
+		int w = snprintf(path + n, sizeof path - n, "%s%s",
+			layers ? " -> " : "", hdr
+		);
+		if (w > 0 && (size_t)w < sizeof path - n) n += w;
+		layers++;
+		for (size_t k = 0; k < sizeof copiers / sizeof *copiers; k++) {
+			if (strstr(hdr, copiers[k])) {
+				copies++;
+				break;
+			}
+		}
+	}
+	snd_output_close(out);
+
+	log_info("%s: PCM path: %s", data->device, path);
+	// hooks and pass-through plugs are fine; it's the copies we mind
+	if (data->direct == AYLP_ALSA_DIRECT_OFF || !copies) return 0;
+	if (data->direct == AYLP_ALSA_DIRECT_REQUIRE) {
+		log_error("%s is not a direct path to the hardware (%u "
+			"converting or copying layers); use a hw: device",
+			data->device, copies
+		);
 		return -1;
 	}
-	*/
+	log_warn("%s is not a direct path to the hardware (%u converting "
+		"or copying layers)", data->device, copies
+	);
+	return 0;
+}
 
+
+/** Sets a card's params to their defaults. */
+static void set_defaults(struct aylp_alsa_data *data)
+{
+	data->device = "front";
+	data->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	data->format = SND_PCM_FORMAT_S16;
+	data->channels = 2;
+	data->rate = 200000;
+	data->buffer_time = 0;
+	data->period_time = 0;
+	data->latency_target_us = 0;
+	data->budget_us = 0;
+	data->not_ready = AYLP_ALSA_HOLD;
+	data->wakeup = AYLP_ALSA_WAKE_IRQ;
+	data->direct = AYLP_ALSA_DIRECT_OFF;
+	data->writer_thread = false;
+	data->ring_slots = 8;
+	data->wait_ms = -1;
+	data->interp.kind = AYLP_ALSA_INTERP_NONE;
+	data->interp_frames = 0;
+	data->interp_taps = 8;
+	data->target_delay = 0;
+	data->pace = 0;
+	data->render_path = NULL;
+	data->render_ring = 0;
+	data->synth_on = false;
+	data->wt_input = false;
+	data->profile_path = NULL;
+	data->probe = false;
+	data->probe_ms = 500;
+	data->adapt = false;
+	data->adapt_interval_ms = 5000;
+	data->adapt_min_period = 16;
+	data->adapt_max_period = 8192;
+	data->stats_path = NULL;
+	data->stats_interval_ms = 1000;
+	data->clock_on = false;
+	data->clock_output = false;
+	data->clock_interval_ms = 1000;
+	data->rt.policy = SCHED_OTHER;
+	data->rt.priority = 0;
+	data->rt.mlock = false;
+	data->rt.prefault = false;
+	pthread_mutex_init(&data->reconf_lock, NULL);
+	atomic_init(&data->reconf_pending, false);
+}
+
+
+/** Opens a card's pcm and negotiates its params. */
+static int open_pcm(struct aylp_alsa_data *data)
+{
+	int err;
 	err = snd_output_stdio_attach(&data->output, stdout, 0);
 	if (err < 0) {
 		log_error("Output failed: %s", snd_strerror(err));
@@ -356,8 +2327,22 @@ int aylp_alsa_init(struct aylp_device *self)
 		data->rate, snd_pcm_format_name(data->format), data->channels
 	);
 
+	// disabling period wakeups has to be allowed at open, as does
+	// keeping plug layers from converting behind our back
+	int mode = 0;
+	if (data->wakeup == AYLP_ALSA_WAKE_TIMER)
+		mode |= SND_PCM_NO_PERIOD_WAKEUP;
+	if (data->direct != AYLP_ALSA_DIRECT_OFF) {
+		mode |= SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS
+			| SND_PCM_NO_AUTO_FORMAT | SND_PCM_NO_SOFTVOL;
+		if (strncmp(data->device, "hw:", 3)) {
+			log_warn("%s isn't a hw: device, so it may go through "
+				"plugins", data->device
+			);
+		}
+	}
 	err = snd_pcm_open(&data->handle, data->device,
-		SND_PCM_STREAM_PLAYBACK, 0
+		SND_PCM_STREAM_PLAYBACK, mode
 	);
 	if (err < 0) {
 		log_error("Playback open error: %s", snd_strerror(err));
@@ -377,60 +2362,820 @@ int aylp_alsa_init(struct aylp_device *self)
 
 	if (log_get_level() >= LOG_TRACE)
 		snd_pcm_dump(data->handle, data->output);
+	if (check_path(data)) return -1;
 
-	data->samples = xmalloc((data->period_size * data->channels
-		* snd_pcm_format_physical_width(data->format)) / 8
-	);
+	if (data->target_delay > data->buffer_size) {
+		log_warn("target_delay %lu is more than the buffer; using %lu",
+			data->target_delay, data->buffer_size
+		);
+		data->target_delay = data->buffer_size;
+	}
+	if (data->pace) {
+		if (pace_room(data, data->pace) > data->buffer_size) {
+			log_error("pace %lu doesn't fit in the buffer (%lu, "
+				"target_delay %lu)", data->pace,
+				data->buffer_size, data->target_delay
+			);
+			return -1;
+		}
+		// irqs only come once a period, so we'd wake late and jitter
+		if (data->wakeup == AYLP_ALSA_WAKE_IRQ
+		&& data->pace % data->period_size) {
+			log_warn("pace %lu isn't a multiple of the period "
+				"(%lu); set period_time or use wakeup timer",
+				data->pace, data->period_size
+			);
+		}
+		log_info("Pacing the pipeline at %g Hz",
+			(double)data->rate / data->pace
+		);
+	}
+
+	pthread_mutex_lock(&playbacks_lock);
+	data->next_playback = playbacks;
+	playbacks = data;
+	pthread_mutex_unlock(&playbacks_lock);
+
+	if (data->budget_us) {
+		// we do our own bounded waiting on the poll descriptors
+		err = snd_pcm_nonblock(data->handle, 1);
+		if (err < 0) {
+			log_error("Can't set nonblocking mode: %s",
+				snd_strerror(err)
+			);
+			return -1;
+		}
+		err = snd_pcm_poll_descriptors_count(data->handle);
+		if (err <= 0) {
+			log_error("Invalid poll descriptors count");
+			return -1;
+		}
+		data->n_pfds = err;
+		data->pfds = xcalloc(data->n_pfds, sizeof(struct pollfd));
+		err = snd_pcm_poll_descriptors(data->handle, data->pfds,
+			data->n_pfds
+		);
+		if (err < 0) {
+			log_error("Unable to obtain poll descriptors: %s",
+				snd_strerror(err)
+			);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+static snd_pcm_uframes_t us_to_frames(const struct aylp_alsa_data *data,
+	unsigned us
+){
+	return (unsigned long long)us * data->rate / 1000000;
+}
+
+
+/** Sets up rendering to data->render_path instead of a pcm. Sizes come from
+ * the same params a card would negotiate them from, taken as they are.
+ */
+static int open_render(struct aylp_alsa_data *data)
+{
+	if (data->have_sizes) {
+		data->period_size = data->sizes.period_size;
+		data->buffer_size = data->sizes.buffer_size;
+	} else if (data->latency_target_us) {
+		data->buffer_size = us_to_frames(data, data->latency_target_us);
+		data->period_size = data->buffer_size / 2;
+	} else {
+		data->period_size = data->period_time
+			? us_to_frames(data, data->period_time) : 1024;
+		data->buffer_size = data->buffer_time
+			? us_to_frames(data, data->buffer_time)
+			: 2 * data->period_size;
+	}
+	if (!data->period_size) data->period_size = 1;
+	if (data->buffer_size < data->period_size)
+		data->buffer_size = data->period_size;
+
+	size_t len = strlen(data->render_path);
+	enum aylp_alsa_render_kind kind = data->render_ring
+		? AYLP_ALSA_RENDER_RING
+		: len >= 4 && !strcasecmp(data->render_path + len - 4, ".wav")
+		? AYLP_ALSA_RENDER_WAV : AYLP_ALSA_RENDER_RAW;
+	if (aylp_alsa_render_open(&data->render, data->render_path, kind,
+		data->format, data->channels, data->rate, data->render_ring
+	)) {
+		return -1;
+	}
 	data->areas = xcalloc(data->channels, sizeof(snd_pcm_channel_area_t));
+	log_info("Rendering %u Hz, %s, %u channels to %s",
+		data->rate, snd_pcm_format_name(data->format), data->channels,
+		data->render_path
+	);
+	return 0;
+}
 
-	for (unsigned c = 0; c < data->channels; c++) {
-		data->areas[c].addr = data->samples;
-		data->areas[c].first = c
-			* snd_pcm_format_physical_width(data->format);
-		data->areas[c].step = data->channels
-			* snd_pcm_format_physical_width(data->format);
+
+/** Checks a card's params, then opens its pcm and sets up its buffers. */
+static int open_card(struct aylp_alsa_data *data)
+{
+	int err;
+	// enforce sane params
+	if (!data->channels || !data->rate) {
+		log_error("channels and rate must be nonzero");
+		return -1;
+	}
+	if (data->writer_thread && data->budget_us) {
+		log_warn("budget_us is ignored with writer_thread");
+		data->budget_us = 0;
+	}
+	if (data->synth_on && (data->writer_thread
+	|| data->interp.kind != AYLP_ALSA_INTERP_NONE)) {
+		log_error("synth doesn't work with writer_thread or interp");
+		return -1;
+	}
+	if (data->wt_on && (data->synth_on || data->writer_thread
+	|| data->interp.kind != AYLP_ALSA_INTERP_NONE)) {
+		log_error("wavetable doesn't work with synth, writer_thread "
+			"or interp"
+		);
+		return -1;
+	}
+	if (data->pace && data->writer_thread) {
+		log_error("pace doesn't work with writer_thread");
+		return -1;
+	}
+	if (data->render_path && (data->writer_thread || data->adapt
+	|| data->clock_on || data->clock_output)) {
+		log_error("render doesn't work with writer_thread, adapt or "
+			"clock"
+		);
+		return -1;
+	}
+	if (data->render_path && data->budget_us) {
+		// a render must come out the same every time
+		log_warn("budget_us is ignored with render");
+		data->budget_us = 0;
+	}
+	if (data->writer_thread && !data->ring_slots) {
+		log_error("ring_slots must be nonzero");
+		return -1;
+	}
+	if (data->clock_output) data->clock_on = true;
+	if (data->clock_on && !data->clock_interval_ms) {
+		log_error("clock_interval_ms must be nonzero");
+		return -1;
+	}
+	if (data->access == SND_PCM_ACCESS_MMAP_COMPLEX) {
+		log_error("Access %s is not supported",
+			snd_pcm_access_name(data->access)
+		);
+		return -1;
+	}
+
+	if (data->probe && !data->profile_path) {
+		log_error("probe needs a profile path to write to");
+		return -1;
+	}
+	if (data->profile_path) {
+		struct aylp_alsa_probe probe = {
+			.device = data->device,
+			.access = data->access,
+			.format = data->format,
+			.channels = data->channels,
+			.run_ms = data->probe_ms,
+		};
+		if (data->probe && aylp_alsa_probe_run(&probe, data->rate,
+			data->profile_path
+		)) {
+			log_warn("Probe failed");
+		}
+		data->have_sizes = !aylp_alsa_profile_load(
+			data->profile_path, &probe, data->rate, &data->sizes
+		);
+		if (!data->have_sizes) {
+			log_warn("No profile for %s at %u Hz in %s; "
+				"negotiating as usual", data->device,
+				data->rate, data->profile_path
+			);
+		}
 	}
 
+	err = data->render_path ? open_render(data) : open_pcm(data);
+	if (err) return err;
+
+	data->rw = data->access == SND_PCM_ACCESS_RW_INTERLEAVED
+		|| data->access == SND_PCM_ACCESS_RW_NONINTERLEAVED;
+	data->planar = data->access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED
+		|| data->access == SND_PCM_ACCESS_RW_NONINTERLEAVED;
+	// render files are always interleaved
+	if (data->render_path) data->rw = data->planar = false;
+	if (data->rw && alloc_staging(data)) return -1;
+
+	// about a page of the held frame, for fill_encoded()
+	size_t frame_bytes = data->channels
+		* (snd_pcm_format_physical_width(data->format) / 8);
+	data->pattern_frames = 4096 / frame_bytes ? 4096 / frame_bytes : 1;
+	data->pattern = aligned_alloc(64,
+		(data->pattern_frames * frame_bytes + 63) & ~(size_t)63
+	);
+	if (!data->pattern) {
+		log_error("Couldn't allocate hold pattern");
+		return -1;
+	}
+	data->held = xcalloc(data->channels, sizeof(double));
+	data->pattern_ok = false;
+
 	data->needs_start = true;
+	data->last = xcalloc(data->channels, sizeof(double));
+	if (data->adapt) {
+		if (!data->adapt_interval_ms || !data->adapt_min_period
+		|| data->adapt_min_period > data->adapt_max_period) {
+			log_error("adapt needs a nonzero interval and "
+				"adapt_min_period <= adapt_max_period"
+			);
+			return -1;
+		}
+		data->adapt_patience = 1;
+		data->adapt_next_ns = now_ns()
+			+ data->adapt_interval_ms * 1000000LL;
+	}
 	data->format_bits = snd_pcm_format_width(data->format);
-	data->maxval = (1 << (data->format_bits - 1)) - 1;
 	data->phys_bps = snd_pcm_format_physical_width(data->format) / 8;
-	data->big_endian = snd_pcm_format_big_endian(data->format);
-	data->to_unsigned = snd_pcm_format_unsigned(data->format);
+	data->big_endian = snd_pcm_format_big_endian(data->format) == 1;
+	data->to_unsigned = snd_pcm_format_unsigned(data->format) == 1;
+	data->conv = aylp_alsa_conv_find(data->format_bits, data->phys_bps,
+		data->big_endian, data->to_unsigned,
+		snd_pcm_format_float(data->format) == 1
+	);
+	if (!data->conv) {
+		log_error("No sample conversion for format %s",
+			snd_pcm_format_name(data->format)
+		);
+		return -1;
+	}
 
-	// set types and units
-	self->type_in = AYLP_T_VECTOR;
-	self->units_in = AYLP_U_MINMAX;
-	self->type_out = 0;
-	self->units_out = 0;
+	if (data->clock_on) {
+		// the rate is only final now that the hw params are set
+		aylp_alsa_clock_init(&data->clock, data->rate,
+			data->clock_interval_ms * 1000000LL, 0.1
+		);
+		pthread_mutex_init(&data->clock_lock, NULL);
+		data->clock_ready = true;
+		err = snd_pcm_status_malloc(&data->status);
+		if (err < 0) {
+			log_error("Couldn't allocate status: %s",
+				snd_strerror(err)
+			);
+			return -1;
+		}
+		data->clock_vec = gsl_vector_alloc(2);
+	}
+
+	if (data->stats_path) {
+		data->stats_block = aylp_alsa_stats_open(data->stats_path);
+		if (!data->stats_block) return -1;
+	}
+
+	if (data->wt_on) {
+		// until we're given a table, loop silence
+		data->wt_params = xcalloc(2 * data->channels, sizeof(double));
+		gsl_matrix *silence = data->wt_init
+			? NULL : gsl_matrix_calloc(data->channels, 1);
+		err = set_table(data, silence ? silence : data->wt_init);
+		if (silence) gsl_matrix_free(silence);
+		if (err) return -1;
+	}
+
+	if (data->synth_on) {
+		aylp_alsa_synth_init(&data->synth, data->channels, data->rate,
+			data->period_size
+		);
+		data->synth_src = (struct aylp_alsa_src){
+			.data = data->synth.out,
+			.ch_stride = 1,
+			.frame_stride = data->channels,
+		};
+	}
+
+	if (data->interp.kind != AYLP_ALSA_INTERP_NONE) {
+		// by default, ramp over what one iteration normally writes
+		if (!data->interp_frames) {
+			// ramp across the frames one paced write covers
+			data->interp_frames = data->pace ? data->pace
+				: data->buffer_size / data->period_size
+				* data->period_size;
+		}
+		aylp_alsa_interp_init(&data->interp, data->interp.kind,
+			data->channels, data->interp_frames, data->interp_taps
+		);
+		data->interp_src = (struct aylp_alsa_src){
+			.data = data->interp.out,
+			.ch_stride = 1,
+			.frame_stride = data->channels,
+		};
+	}
+
+	if (data->writer_thread) {
+		aylp_alsa_ring_init(&data->ring, data->ring_slots,
+			data->channels, data->period_size
+		);
+		data->hold = xcalloc(data->channels, sizeof(double));
+		data->mail = xcalloc(data->channels, sizeof(double));
+		aylp_alsa_mailbox_init(&data->mailbox, data->channels);
+		data->mailbox_seen = 0;
+		atomic_init(&data->ring_drops, 0);
+	}
 	return 0;
 }
 
 
-int aylp_alsa_process(struct aylp_device *self, struct aylp_state *state)
+/** Starts a card's writer thread, or if it doesn't have one, applies its
+ * real-time settings to this thread, which will be calling process().
+ */
+static int start_card(struct aylp_alsa_data *data)
+{
+	int err;
+	// touch everything before the first write
+	if (data->rt.prefault) prefault_buffers(data);
+
+	if (data->writer_thread) {
+		// time out of waits so we notice when it's time to stop
+		data->wait_ms = 100;
+		atomic_init(&data->stop, false);
+		err = pthread_create(&data->thread, NULL, writer_thread, data);
+		if (err) {
+			log_error("Couldn't start writer thread: %s",
+				strerror(err)
+			);
+			return -1;
+		}
+		data->thread_running = true;
+	} else {
+		// process() does the writes, and it's called from this thread
+		apply_rt(data);
+	}
+	return 0;
+}
+
+
+/** Opens one card per entry in the devices param and links them so they start
+ * together. Each card takes the top-level params, then its own entry's.
+ */
+static int open_cards(struct aylp_alsa_data *data, json_object *params)
+{
+	int err;
+	data->n_cards = json_object_array_length(data->devices);
+	if (!data->n_cards) {
+		log_error("devices must not be empty");
+		return -1;
+	}
+	if (data->stats_path) {
+		// one file can't hold several cards' stats
+		log_error("With devices, stats_path must be set per card");
+		return -1;
+	}
+	data->cards = xcalloc(data->n_cards, sizeof(struct aylp_alsa_data));
+	data->channels = 0;
+	for (unsigned k = 0; k < data->n_cards; k++) {
+		struct aylp_alsa_data *card = &data->cards[k];
+		json_object *entry = json_object_array_get_idx(
+			data->devices, k
+		);
+		if (!json_object_is_type(entry, json_type_object)) {
+			log_error("devices must be an array of objects");
+			return -1;
+		}
+		set_defaults(card);
+		err = parse_params(card, params);
+		if (err) return err;
+		// routing and output belong to the whole device, and each
+		// card needs its own stats file
+		if (card->routing) gsl_matrix_free(card->routing);
+		card->routing = NULL;
+		card->devices = NULL;
+		card->stats_path = NULL;
+		if (card->clock_output) card->clock_on = true;
+		card->clock_output = false;
+		err = parse_params(card, entry);
+		if (err) return err;
+		if (card->routing || card->devices || card->clock_output) {
+			log_error("routing, devices and clock_output can't be "
+				"set per card"
+			);
+			return -1;
+		}
+		err = open_card(card);
+		if (err) return err;
+		data->channels += card->channels;
+	}
+
+	data->group = xcalloc(1, sizeof(struct aylp_alsa_group));
+	pthread_mutex_init(&data->group->lock, NULL);
+	data->group->cards = data->cards;
+	data->group->n_cards = data->n_cards;
+	for (unsigned k = 0; k < data->n_cards; k++) {
+		struct aylp_alsa_data *card = &data->cards[k];
+		if (k) {
+			err = snd_pcm_link(data->cards[0].handle, card->handle);
+			if (err < 0) {
+				log_error("Couldn't link %s to %s: %s",
+					card->device, data->cards[0].device,
+					snd_strerror(err)
+				);
+				return -1;
+			}
+		}
+		card->group = data->group;
+	}
+	log_info("Fanning %u channels out over %u linked cards",
+		data->channels, data->n_cards
+	);
+	return 0;
+}
+
+
+int aylp_alsa_init(struct aylp_device *self)
 {
 	int err;
+	self->device_data = xcalloc(1, sizeof(struct aylp_alsa_data));
 	struct aylp_alsa_data *data = self->device_data;
-	if (UNLIKELY(state->vector->size != data->channels)) {
-		log_error("Pipeline vector is size %u but we have %u channels",
-			state->vector->size, data->channels
+	// attach methods
+	self->process = &aylp_alsa_process;
+	self->close = &aylp_alsa_close;
+
+	// default params
+	set_defaults(data);
+	// parse the params json into our data struct
+	if (self->params) {
+		err = parse_params(data, self->params);
+		if (err) return err;
+	}
+
+	if (data->devices && data->render_path) {
+		log_error("render doesn't work with devices");
+		return -1;
+	}
+	if (data->devices) {
+		err = open_cards(data, self->params);
+	} else {
+		err = open_card(data);
+	}
+	if (err) return err;
+	// a routed vector has one element per channel, whatever the cards
+	if (data->routing && input_width(data) != data->channels) {
+		log_error("synth and wavetable don't work with routing");
+		return -1;
+	}
+	if (data->routing && data->routing->size1 != data->channels) {
+		log_error("routing has %zu rows but we have %u channels",
+			data->routing->size1, data->channels
+		);
+		return -1;
+	}
+	if (data->routing) data->routed = gsl_vector_alloc(data->channels);
+
+	// mlockall() is process-wide, so lock once, now that every card has
+	// allocated what it writes from, and before any of them starts
+	const struct aylp_alsa_rt *rt = &data->rt;
+	for (unsigned k = 0; k < data->n_cards; k++)
+		if (data->cards[k].rt.mlock) rt = &data->cards[k].rt;
+	aylp_alsa_rt_lock(rt);
+
+	if (data->n_cards) {
+		// cards only start once they're all linked
+		for (unsigned k = 0; k < data->n_cards; k++) {
+			err = start_card(&data->cards[k]);
+			if (err) return err;
+		}
+	} else {
+		err = start_card(data);
+		if (err) return err;
+	}
+
+	// set types and units
+	self->type_in = AYLP_T_VECTOR | AYLP_T_MATRIX;
+	self->units_in = AYLP_U_MINMAX;
+	if (data->clock_output) {
+		self->type_out = AYLP_T_VECTOR;
+		self->units_out = AYLP_U_COUNTS;
+	} else {
+		self->type_out = 0;
+		self->units_out = 0;
+	}
+	return 0;
+}
+
+
+/** Blocks until the card has room for data->pace frames past the target
+ * delay (if any) and writes exactly that many, so it's the card's clock that
+ * paces the pipeline. The caller fills the buffer the usual way until the pcm
+ * is running.
+ */
+static int write_paced(struct aylp_alsa_data *data,
+	const struct aylp_alsa_src *src
+){
+	int err = wait_queue(data, data->pace);
+	// out of time, or wait_ms ran out; try again next time
+	if (err == -EAGAIN) return 0;
+	if (UNLIKELY(err < 0)) return err;
+	// synth, wavetable wraps and short writes can each cut a write short
+	snd_pcm_uframes_t left = data->pace;
+	while (left) {
+		snd_pcm_sframes_t done = write_period(data, src, left);
+		if (done == -EAGAIN) return 0;	// out of time
+		if (done < 0) return done;
+		left -= done;
+	}
+	return 0;
+}
+
+
+/** Writes one pipeline vector or block to the pcm from this thread. */
+static int write_input(struct aylp_alsa_data *data, const gsl_vector *vec,
+	const gsl_matrix *block
+){
+	if (data->wt_on) {
+		// a matrix is a new table, unless it's meant as samples
+		if (block && data->wt_input) {
+			if (set_table(data, block)) return -1;
+			// play on from it with the gain and offset we have
+			encode_table(data, data->wt_params, 1);
+			block = NULL;
+		} else if (!block) {
+			encode_table(data, vec->data, vec->stride);
+		}
+	}
+	if (block)
+		return process_block(data, block);
+	if (data->interp.kind != AYLP_ALSA_INTERP_NONE) {
+		// ramp from the previous value to this one
+		aylp_alsa_interp_run(&data->interp, vec->data, vec->stride);
+		return write_frames(data, data->interp_src,
+			data->interp.frames
 		);
 	}
+	// the vector is oscillator parameters, not samples
+	if (data->synth_on)
+		aylp_alsa_synth_set(&data->synth, vec->data, vec->stride);
+	// hold each channel's value for all the frames we write (a new
+	// wavetable, which comes without a vector, supplies its own)
+	struct aylp_alsa_src src = {.ch_stride = 1};
+	if (vec) {
+		src.data = vec->data;
+		src.ch_stride = vec->stride;
+	}
+	if (data->render_path) {
+		// offline, each vector is worth a fixed number of frames
+		snd_pcm_uframes_t frames = data->pace
+			? data->pace : data->period_size;
+		while (frames) {
+			snd_pcm_sframes_t done = write_period(data, &src,
+				frames
+			);
+			if (done <= 0) return done;
+			frames -= done;
+		}
+		return 0;
+	}
+	if (data->pace && !data->needs_start)
+		return write_paced(data, &src);
+	if (data->target_delay) {
+		snd_pcm_sframes_t err = top_up(data, &src);
+		return err < 0 && err != -EAGAIN ? err : 0;
+	}
 	for (unsigned p = 0; p < data->buffer_size / data->period_size; p++) {
 		log_trace("Processing period %u", p);
-		err = process_period(data, state);
-		if (err) return err;
+		snd_pcm_sframes_t err = write_period(data, &src,
+			data->period_size
+		);
+		if (err == -EAGAIN) break;	// out of time
+		if (err < 0) return err;
 	}
 	return 0;
 }
 
 
-int aylp_alsa_close(struct aylp_device *self)
+/** Replaces the pipeline state with our clock estimates. */
+static void emit_clock(struct aylp_alsa_data *data, struct aylp_state *state)
+{
+	pthread_mutex_lock(&data->clock_lock);
+	gsl_vector_set(data->clock_vec, 0, data->clock.ratio);
+	gsl_vector_set(data->clock_vec, 1, data->clock.delay_s);
+	pthread_mutex_unlock(&data->clock_lock);
+	state->vector = data->clock_vec;
+	state->header.type = AYLP_T_VECTOR;
+	state->header.units = AYLP_U_COUNTS;
+	state->header.log_dim.y = data->clock_vec->size;
+	state->header.log_dim.x = 1;
+}
+
+
+/** Hands one pipeline vector or block to a card, by thread or directly. */
+static int card_input(struct aylp_alsa_data *data, const gsl_vector *vec,
+	const gsl_matrix *block, long long deadline_ns
+){
+	if (data->writer_thread)
+		return push_input(data, vec, block);
+	data->deadline_ns = deadline_ns;
+	return write_input(data, vec, block);
+}
+
+
+/** Splits the channels of vec or block across our cards, in order. */
+static int fan_out(struct aylp_alsa_data *data, const gsl_vector *vec,
+	const gsl_matrix *block, long long deadline_ns
+){
+	int err = 0;
+	size_t first = 0;
+	for (unsigned k = 0; k < data->n_cards; k++) {
+		struct aylp_alsa_data *card = &data->cards[k];
+		int card_err;
+		if (block) {
+			gsl_matrix_const_view m = gsl_matrix_const_submatrix(
+				block, first, 0, card->channels, block->size2
+			);
+			card_err = card_input(card, NULL, &m.matrix,
+				deadline_ns
+			);
+		} else {
+			gsl_vector_const_view v = gsl_vector_const_subvector(
+				vec, first, input_width(card)
+			);
+			card_err = card_input(card, &v.vector, NULL,
+				deadline_ns
+			);
+		}
+		// keep the other cards going, but report the first error
+		if (card_err && !err) err = card_err;
+		first += block ? card->channels : input_width(card);
+	}
+	return err;
+}
+
+
+int aylp_alsa_process(struct aylp_device *self, struct aylp_state *state)
 {
 	struct aylp_alsa_data *data = self->device_data;
-	if (data->handle) snd_pcm_close(data->handle);
+	gsl_vector *vec;
+	gsl_matrix *block;
+	int err;
+	if (route_input(data, state, &vec, &block)) return -1;
+	// one budget for all the cards
+	long long deadline_ns = 0;
+	if (data->budget_us)
+		deadline_ns = now_ns() + data->budget_us * 1000LL;
+	if (data->n_cards) {
+		err = fan_out(data, vec, block, deadline_ns);
+	} else {
+		err = card_input(data, vec, block, deadline_ns);
+	}
+	if (data->clock_output) {
+		// with several cards, report the first one's clock
+		emit_clock(data->n_cards ? &data->cards[0] : data, state);
+	}
+	return err;
+}
+
+
+int aylp_alsa_reconfigure(struct aylp_device *self, unsigned rate,
+	snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size
+){
+	struct aylp_alsa_data *data = self->device_data;
+	if (data->n_cards) {
+		log_error("Can't reconfigure linked cards");
+		return -1;
+	}
+	if (data->render_path) {
+		log_error("Can't reconfigure a render");
+		return -1;
+	}
+	pthread_mutex_lock(&data->reconf_lock);
+	data->reconf = (struct aylp_alsa_reconf){
+		.rate = rate,
+		.period_size = period_size,
+		.buffer_size = buffer_size,
+	};
+	atomic_store_explicit(&data->reconf_pending, true,
+		memory_order_release
+	);
+	pthread_mutex_unlock(&data->reconf_lock);
+	return 0;
+}
+
+
+snd_pcm_t *aylp_alsa_find_playback(const char *device)
+{
+	snd_pcm_t *handle = NULL;
+	pthread_mutex_lock(&playbacks_lock);
+	for (struct aylp_alsa_data *d = playbacks; d; d = d->next_playback) {
+		if (!strcmp(d->device, device)) {
+			handle = d->handle;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&playbacks_lock);
+	return handle;
+}
+
+
+/** Stops a card's thread and closes its pcm, then frees what it allocated. */
+static void close_card(struct aylp_alsa_data *data)
+{
+	pthread_mutex_lock(&playbacks_lock);
+	for (struct aylp_alsa_data **d = &playbacks; *d;
+	d = &(*d)->next_playback) {
+		if (*d == data) {
+			*d = data->next_playback;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&playbacks_lock);
+	if (data->thread_running) {
+		atomic_store_explicit(&data->stop, true, memory_order_relaxed);
+		pthread_join(data->thread, NULL);
+	}
+	if (data->handle) {
+		snd_pcm_close(data->handle);
+		log_info("%s: %llu xruns, %llu suspends, %llu restarts "
+			"over %llu frames",
+			data->device,
+			(unsigned long long)data->stats.xruns,
+			(unsigned long long)data->stats.suspends,
+			(unsigned long long)data->stats.restarts,
+			(unsigned long long)data->stats.frames
+		);
+	}
+	if (data->render_path) {
+		log_info("Rendered %llu frames to %s",
+			(unsigned long long)data->render.frames,
+			data->render_path
+		);
+		aylp_alsa_render_close(&data->render);
+	}
+	if (data->stats_block) {
+		data->stats.drops = atomic_load_explicit(&data->ring_drops,
+			memory_order_relaxed
+		);
+		aylp_alsa_stats_publish(data->stats_block, &data->stats,
+			now_ns()
+		);
+		aylp_alsa_stats_close(data->stats_block);
+	}
+	if (data->clock_ready) {
+		log_info("Card clock ratio %.9f (%+.2f ppm) over %llu "
+			"measurements; output delay %lld frames",
+			data->clock.ratio, (data->clock.ratio - 1.0) * 1e6,
+			(unsigned long long)data->clock.n,
+			data->clock.delay_frames
+		);
+		pthread_mutex_destroy(&data->clock_lock);
+		if (data->status) snd_pcm_status_free(data->status);
+		if (data->clock_vec) gsl_vector_free(data->clock_vec);
+		data->clock_ready = false;
+	}
+	aylp_alsa_ring_free(&data->ring);
+	aylp_alsa_interp_free(&data->interp);
+	if (data->synth_on) aylp_alsa_synth_free(&data->synth);
+	if (data->wt_init) gsl_matrix_free(data->wt_init);
+	if (data->wt) gsl_matrix_free(data->wt);
+	xfree(data->wt_scaled);
+	free(data->wt_enc);	// from aligned_alloc()
+	xfree(data->wt_params);
+	xfree(data->hold);
+	xfree(data->mail);
+	aylp_alsa_mailbox_free(&data->mailbox);
+	xfree(data->last);
+	aylp_alsa_rt_free(&data->rt);
+	if (data->routing) gsl_matrix_free(data->routing);
+	if (data->routed) gsl_vector_free(data->routed);
+	if (data->routed_block) gsl_matrix_free(data->routed_block);
+	xfree(data->pfds);
+	xfree(data->planes);
 	xfree(data->areas);
-	xfree(data->samples);
+	free(data->samples);	// from aligned_alloc()
+	free(data->pattern);
+	xfree(data->held);
+	pthread_mutex_destroy(&data->reconf_lock);
+}
+
+
+int aylp_alsa_close(struct aylp_device *self)
+{
+	struct aylp_alsa_data *data = self->device_data;
+	// stop every writer before we start closing linked pcms
+	for (unsigned k = 0; k < data->n_cards; k++) {
+		atomic_store_explicit(&data->cards[k].stop, true,
+			memory_order_relaxed
+		);
+	}
+	for (unsigned k = 0; k < data->n_cards; k++)
+		close_card(&data->cards[k]);
+	xfree(data->cards);
+	if (data->group) {
+		pthread_mutex_destroy(&data->group->lock);
+		xfree(data->group);
+	}
+	close_card(data);
 	xfree(self->device_data);
 	return 0;
 }
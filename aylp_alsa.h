@@ -2,15 +2,94 @@
 #ifndef AYLP_ALSA_H_
 #define AYLP_ALSA_H_
 
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <alsa/asoundlib.h>
 
 #include "anyloop.h"
+#include "aylp_alsa_clock.h"
+#include "aylp_alsa_conv.h"
+#include "aylp_alsa_interp.h"
+#include "aylp_alsa_probe.h"
+#include "aylp_alsa_render.h"
+#include "aylp_alsa_ring.h"
+#include "aylp_alsa_rt.h"
+#include "aylp_alsa_stats.h"
+#include "aylp_alsa_synth.h"
+
+// what a deadline-bounded process() does when the card has no room
+enum aylp_alsa_not_ready {
+	// give up on this iteration right away
+	AYLP_ALSA_SKIP,
+	// write whatever room there is, then give up
+	AYLP_ALSA_PARTIAL,
+	// wait for room, but never past the deadline
+	AYLP_ALSA_HOLD,
+};
+
+// how we find out there's room in the buffer
+enum aylp_alsa_wakeup {
+	// sleep in poll() until a period interrupt
+	AYLP_ALSA_WAKE_IRQ,
+	// disable period interrupts and sleep until the hw pointer should
+	// have moved far enough
+	AYLP_ALSA_WAKE_TIMER,
+	// spin on snd_pcm_avail()
+	AYLP_ALSA_WAKE_BUSY,
+};
+
+// how hard we insist on writing straight to the hardware
+enum aylp_alsa_direct {
+	// take whatever path the device name leads to
+	AYLP_ALSA_DIRECT_OFF,
+	// open without automatic conversions, pick native access and format,
+	// and warn if anything between us and the hardware converts or copies
+	AYLP_ALSA_DIRECT_WARN,
+	// the same, but fail instead of warning
+	AYLP_ALSA_DIRECT_REQUIRE,
+};
+
+// a run of input samples for process_period()
+struct aylp_alsa_src {
+	// first sample of the first channel
+	const double *data;
+	// distance between channels [doubles]
+	size_t ch_stride;
+	// distance between frames [doubles]; 0 holds each channel's value
+	size_t frame_stride;
+	// if non-NULL, the same frames already in our format (interleaved,
+	// or one plane of enc_frames per channel), enc_frames long and
+	// repeating, starting at frame enc_pos
+	const unsigned char *enc;
+	size_t enc_frames;
+	size_t enc_pos;
+};
+
+struct aylp_alsa_data;
+
+// a reconfiguration for the writing thread to apply; zeros keep what we have
+struct aylp_alsa_reconf {
+	unsigned rate;
+	snd_pcm_uframes_t period_size;
+	// 0 keeps the number of periods per buffer
+	snd_pcm_uframes_t buffer_size;
+};
+
+// cards linked with snd_pcm_link(), so they start and stop together
+struct aylp_alsa_group {
+	struct aylp_alsa_data *cards;
+	unsigned n_cards;
+	// held while deciding whether to start the group
+	pthread_mutex_t lock;
+};
 
 struct aylp_alsa_data {
 	snd_pcm_t *handle;
 	snd_output_t *output;
 	snd_pcm_hw_params_t *hwparams;
 	snd_pcm_sw_params_t *swparams;
+	// layout of samples, for rw access
 	snd_pcm_channel_area_t *areas;
 	// playback device from `aplay -L` (e.g. "front")
 	char *device;
@@ -28,20 +107,211 @@ struct aylp_alsa_data {
 	// requested time and returned size of period
 	unsigned period_time;
 	snd_pcm_uframes_t period_size;
+	// if we insist on no conversion layers between us and the hardware
+	enum aylp_alsa_direct direct;
+	// if nonzero, negotiate the smallest buffer near this latency [us]
+	// instead of using buffer_time and period_time
+	unsigned latency_target_us;
+	// tuning profile to open with, or NULL to negotiate from scratch
+	const char *profile_path;
+	// if true, probe the device and (re)write profile_path at init
+	bool probe;
+	// how long to play each candidate period while probing [ms]
+	unsigned probe_ms;
+	// exact buffer and period to set, from the profile or a
+	// reconfiguration, if have_sizes
+	struct aylp_alsa_profile sizes;
+	bool have_sizes;
+	// if nonzero, bound each process() call to this many us, polling
+	// the pcm instead of blocking on it
+	unsigned budget_us;
+	// what to do when there's no room before the deadline
+	enum aylp_alsa_not_ready not_ready;
+	// end of this iteration's budget (CLOCK_MONOTONIC) [ns]
+	long long deadline_ns;
+	// poll descriptors for the pcm
+	struct pollfd *pfds;
+	unsigned n_pfds;
+	// how we wait for room
+	enum aylp_alsa_wakeup wakeup;
+	// timeout for waits outside of deadline mode [ms], or -1 to wait
+	// forever
+	int wait_ms;
+	// if true, process() only pushes into the ring and a writer thread
+	// does all the pcm I/O
+	bool writer_thread;
+	// number of slots in the ring, each holding up to one period
+	unsigned ring_slots;
+	struct aylp_alsa_ring ring;
+	pthread_t thread;
+	bool thread_running;
+	// tells the writer thread to exit
+	atomic_bool stop;
+	// per-channel value the writer thread holds between blocks
+	double *hold;
+	// the newest held vector for the writer thread, and the mailbox seq
+	// it last took one from
+	struct aylp_alsa_mailbox mailbox;
+	size_t mailbox_seen;
+	// where the writer thread reads the mailbox into
+	double *mail;
+	// frames process() dropped because the ring was full; the writer
+	// thread copies this into stats
+	atomic_uint_least64_t ring_drops;
+	// reconstruction between successive pipeline vectors
+	struct aylp_alsa_interp interp;
+	// frames to interpolate over (0 means one buffer's worth of periods)
+	size_t interp_frames;
+	// filter length for sinc interpolation [pipeline values]
+	unsigned interp_taps;
+	// queued by aylp_alsa_reconfigure() for the writing thread
+	struct aylp_alsa_reconf reconf;
+	pthread_mutex_t reconf_lock;
+	atomic_bool reconf_pending;
+	// if true, halve the period while there are no xruns and double it
+	// when there are
+	bool adapt;
+	// how often to reconsider the period [ms]
+	unsigned adapt_interval_ms;
+	// limits on the period we adapt to [frames]
+	snd_pcm_uframes_t adapt_min_period;
+	snd_pcm_uframes_t adapt_max_period;
+	// CLOCK_MONOTONIC time to reconsider the period next [ns]
+	long long adapt_next_ns;
+	// stats.xruns when we last reconsidered
+	uint64_t adapt_xruns;
+	// clean intervals so far, and how many we need before shrinking
+	unsigned adapt_clean;
+	unsigned adapt_patience;
+	// if true, each channel takes AYLP_ALSA_SYNTH_PARAMS pipeline
+	// elements and we write its oscillator instead of holding a level
+	bool synth_on;
+	struct aylp_alsa_synth synth;
+	// synth.out as a source for process_period()
+	struct aylp_alsa_src synth_src;
+	// if true, loop a wavetable instead of holding a level, with each
+	// channel's gain and offset from the pipeline vector
+	bool wt_on;
+	// the table from the wavetable param, if any
+	gsl_matrix *wt_init;
+	// if true, a pipeline matrix replaces the table instead of being
+	// written as samples
+	bool wt_input;
+	// the table, channels x wt_frames, tiled to at least a period, in a
+	// matrix with room for wt_cap frames
+	gsl_matrix *wt;
+	size_t wt_frames;
+	size_t wt_cap;
+	// frames in the table before tiling
+	size_t wt_len;
+	// wt with the current gain and offset applied, channels x frames,
+	// and that encoded in our format like pattern
+	double *wt_scaled;
+	unsigned char *wt_enc;
+	// gain and offset per channel that wt_enc holds, and if it holds
+	// anything yet
+	double *wt_params;
+	bool wt_ok;
+	// next frame of the table to play
+	size_t wt_pos;
+	// if nonzero, write held vectors only until this many frames are
+	// queued (by snd_pcm_delay()), instead of filling the buffer
+	snd_pcm_uframes_t target_delay;
+	// if nonzero, each process() blocks until this many frames can be
+	// written and writes exactly that many, so the card sets the loop rate
+	snd_pcm_uframes_t pace;
+	// if non-NULL, write to this file as fast as we can instead of
+	// opening a pcm
+	const char *render_path;
+	// if nonzero, the render file is a ring of this many frames
+	size_t render_ring;
+	struct aylp_alsa_render render;
+	// interp.out as a source for process_period()
+	struct aylp_alsa_src interp_src;
+	// scheduling, memory locking and pinning for the thread doing writes
+	struct aylp_alsa_rt rt;
+	// counters and histograms
+	struct aylp_alsa_stats stats;
+	// where to publish stats, or NULL not to
+	const char *stats_path;
+	// how often to publish stats [ms]
+	unsigned stats_interval_ms;
+	// mapped stats_path
+	struct aylp_alsa_stats_block *stats_block;
+	// CLOCK_MONOTONIC time to publish stats next [ns]
+	long long stats_next_ns;
+	// if true, estimate the card's clock rate and our output delay
+	bool clock_on;
+	// if true, also emit the estimates as our output vector
+	bool clock_output;
+	// shortest interval to measure the clock ratio over [ms]
+	unsigned clock_interval_ms;
+	struct aylp_alsa_clock clock;
+	// guards clock between the writer thread and process()
+	pthread_mutex_t clock_lock;
+	// if true, open_card() set up clock, clock_lock, status and clock_vec
+	// (it never runs on the top level of a devices setup)
+	bool clock_ready;
+	snd_pcm_status_t *status;
+	// {rate ratio, delay [s]} for clock_output
+	gsl_vector *clock_vec;
+	// frames committed to the pcm since init
+	uint64_t written;
+	// if the pcm has ever been started
+	bool started;
+	// if we've seen a suspend we haven't recovered from yet
+	bool suspended;
+	// last frame we wrote, which we fill with after an xrun
+	double *last;
 	// if the pcm needs to be started
 	bool needs_start;
-	// TODO: check this out
-	signed short *samples;
+	// if we use snd_pcm_writei()/writen() rather than mmap
+	bool rw;
+	// if each channel has its own plane (a NONINTERLEAVED access)
+	bool planar;
+	// the held frame, encoded and repeated over pattern_frames frames:
+	// interleaved, or as one run per channel if planar
+	unsigned char *pattern;
+	size_t pattern_frames;
+	// the values pattern holds, and if it holds anything yet
+	double *held;
+	bool pattern_ok;
+	// cache-aligned staging buffer of one period for rw access
+	unsigned char *samples;
+	// bytes between channel planes in samples for RW_NONINTERLEAVED
+	size_t plane_bytes;
+	// per-channel pointers into samples for snd_pcm_writen()
+	void **planes;
 	// how many bits in our format
 	int format_bits;
-	// maximum unsigned value in our format
-	unsigned maxval;
 	// physical bits per sample (usually same as format_bits)
 	int phys_bps;
 	// is the requested format big endian?
 	bool big_endian;
 	// is the requested format unsigned?
 	bool to_unsigned;
+	// sample conversion kernel for our format
+	aylp_alsa_conv_fn conv;
+	// channels x inputs gains from the pipeline vector to our channels, or
+	// NULL to map input i straight to channel i
+	gsl_matrix *routing;
+	// routing applied to the pipeline vector or matrix
+	gsl_vector *routed;
+	gsl_matrix *routed_block;
+	// if we've already warned about a vector longer than our channels
+	bool warned_size;
+	// per-card params from the devices param, or NULL for one card
+	json_object *devices;
+	// the cards we fan out to, each set up like a single-card device
+	struct aylp_alsa_data *cards;
+	unsigned n_cards;
+	// the group this card belongs to, or NULL if it's on its own
+	struct aylp_alsa_group *group;
+	// if this card's buffer is full and waiting on the group to start
+	// (guarded by group->lock)
+	bool full;
+	// next open playback, for aylp_alsa_find_playback()
+	struct aylp_alsa_data *next_playback;
 };
 
 // initialize alsa device
@@ -50,6 +320,18 @@ int aylp_alsa_init(struct aylp_device *self);
 // write vector to alsa
 int aylp_alsa_process(struct aylp_device *self, struct aylp_state *state);
 
+/** Queues a change of rate, period and buffer size, which the writing thread
+ * applies before its next period by dropping the pcm and setting it up again.
+ * Zeros keep the current values (and a zero buffer_size keeps the number of
+ * periods per buffer). Not supported with several cards.
+ */
+int aylp_alsa_reconfigure(struct aylp_device *self, unsigned rate,
+	snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size
+);
+
+// pcm of the open aylp_alsa playback on device, or NULL if there isn't one
+snd_pcm_t *aylp_alsa_find_playback(const char *device);
+
 // close alsa device when loop exits
 int aylp_alsa_close(struct aylp_device *self);
 
@@ -0,0 +1,471 @@
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#include "anyloop.h"
+#include "logging.h"
+#include "xalloc.h"
+#include "aylp_alsa.h"
+#include "aylp_alsa_capture.h"
+
+// how many times to retry snd_pcm_resume(), 10 ms apart, before preparing
+#define RESUME_TRIES 100
+
+/** Sets hardware and software parameters from the data struct. */
+static int set_params(struct aylp_alsa_capture_data *data)
+{
+	int err;
+	int dir = 0;
+	snd_pcm_t *handle = data->handle;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	err = snd_pcm_hw_params_any(handle, hw);
+	if (err < 0) {
+		log_error("No capture configurations available: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	err = snd_pcm_hw_params_set_access(handle, hw, data->access);
+	if (err < 0) {
+		log_error("Access type not available for capture: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	err = snd_pcm_hw_params_set_format(handle, hw, data->format);
+	if (err < 0) {
+		log_error("Sample format not available for capture: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	err = snd_pcm_hw_params_set_channels(handle, hw, data->channels);
+	if (err < 0) {
+		log_error("Channels count (%u) not available: %s",
+			data->channels, snd_strerror(err)
+		);
+		return err;
+	}
+	unsigned rrate = data->rate;
+	err = snd_pcm_hw_params_set_rate_near(handle, hw, &data->rate, 0);
+	if (err < 0) {
+		log_error("Rate (%u Hz) not available for capture: %s",
+			rrate, snd_strerror(err)
+		);
+		return err;
+	}
+	if (rrate != data->rate) {
+		log_warn("Rate doesn't match (requested %u Hz, got %u Hz)",
+			rrate, data->rate
+		);
+	}
+	if (data->buffer_time) {
+		err = snd_pcm_hw_params_set_buffer_time_near(handle, hw,
+			&data->buffer_time, &dir
+		);
+		if (err < 0) {
+			log_error("Unable to set buffer time %u for capture: "
+				"%s", data->buffer_time, snd_strerror(err)
+			);
+			return err;
+		}
+	}
+	if (data->period_time) {
+		err = snd_pcm_hw_params_set_period_time_near(handle, hw,
+			&data->period_time, &dir
+		);
+		if (err < 0) {
+			log_error("Unable to set period time %u for capture: "
+				"%s", data->period_time, snd_strerror(err)
+			);
+			return err;
+		}
+	}
+	err = snd_pcm_hw_params(handle, hw);
+	if (err < 0) {
+		log_error("Unable to set hw params for capture: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	snd_pcm_hw_params_get_buffer_size(hw, &data->buffer_size);
+	snd_pcm_hw_params_get_period_size(hw, &data->period_size, &dir);
+
+	err = snd_pcm_sw_params_current(handle, sw);
+	if (err < 0) {
+		log_error("Unable to determine current swparams for capture: "
+			"%s", snd_strerror(err)
+		);
+		return err;
+	}
+	// we start the pcm ourselves (or our linked playback does)
+	snd_pcm_uframes_t boundary;
+	snd_pcm_sw_params_get_boundary(sw, &boundary);
+	snd_pcm_sw_params_set_start_threshold(handle, sw, boundary);
+	err = snd_pcm_sw_params_set_avail_min(handle, sw, data->period_size);
+	if (err < 0) {
+		log_error("Unable to set avail min for capture: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	err = snd_pcm_sw_params(handle, sw);
+	if (err < 0) {
+		log_error("Unable to set sw params for capture: %s",
+			snd_strerror(err)
+		);
+		return err;
+	}
+	return 0;
+}
+
+
+/** Links our pcm to the playback of an aylp_alsa device, if it's open yet. */
+static void link_playback(struct aylp_alsa_capture_data *data)
+{
+	snd_pcm_t *playback = aylp_alsa_find_playback(data->link);
+	if (!playback) return;
+	int err = snd_pcm_link(data->handle, playback);
+	if (err < 0) {
+		log_warn("Couldn't link to %s, so running unlinked: %s",
+			data->link, snd_strerror(err)
+		);
+		data->link = NULL;
+		return;
+	}
+	data->linked = true;
+	log_info("Linked capture %s to playback %s",
+		data->device, data->link
+	);
+}
+
+
+/** Recovers from an overrun (-EPIPE) or suspend (-ESTRPIPE). */
+static int recover(struct aylp_alsa_capture_data *data, int err)
+{
+	if (err == -EPIPE) {
+		log_warn("Recovering from overrun");
+		data->xruns++;
+		err = snd_pcm_prepare(data->handle);
+	} else if (err == -ESTRPIPE) {
+		log_warn("Recovering from suspend");
+		// a device that never resumes gets prepared instead
+		unsigned tries = 0;
+		while ((err = snd_pcm_resume(data->handle)) == -EAGAIN
+		&& ++tries < RESUME_TRIES) {
+			struct timespec ts = {.tv_nsec = 10000000};
+			nanosleep(&ts, NULL);
+		}
+		if (err < 0) err = snd_pcm_prepare(data->handle);
+	}
+	if (err < 0) {
+		log_error("Can't recover capture: %s", snd_strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+
+/** Makes sure the pcm is running.
+ * Returns 0 if it is, 1 if we're waiting on our linked playback to start us,
+ * or a negative error code.
+ */
+static int ensure_running(struct aylp_alsa_capture_data *data)
+{
+	int err;
+	snd_pcm_state_t state = snd_pcm_state(data->handle);
+	if (UNLIKELY(state == SND_PCM_STATE_XRUN
+	|| state == SND_PCM_STATE_SUSPENDED)) {
+		err = recover(data, state == SND_PCM_STATE_XRUN
+			? -EPIPE : -ESTRPIPE
+		);
+		if (err) return err;
+		state = snd_pcm_state(data->handle);
+	}
+	if (state != SND_PCM_STATE_PREPARED) return 0;
+	// linked streams start together once the playback buffer is full
+	if (data->linked) return 1;
+	err = snd_pcm_start(data->handle);
+	if (err < 0) {
+		log_error("Capture start error: %s", snd_strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+
+/** Converts up to size frames from the mmap areas into data->block, starting
+ * at frame `at`, and commits them.
+ * Returns the number of frames read or a negative error code.
+ */
+static snd_pcm_sframes_t read_areas(struct aylp_alsa_capture_data *data,
+	size_t at, snd_pcm_uframes_t size
+){
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames = size;
+	int err = snd_pcm_mmap_begin(data->handle, &areas, &offset, &frames);
+	if (err < 0) return err;
+	for (unsigned c = 0; c < data->channels; c++) {
+		if (UNLIKELY((areas[c].first | areas[c].step) % 8)) {
+			log_error("Channel %u isn't byte-aligned", c);
+			return -EINVAL;
+		}
+		const unsigned char *src = (const unsigned char *)areas[c].addr
+			+ areas[c].first / 8 + offset * (areas[c].step / 8);
+		data->deconv(data->block->data + c * data->block->tda + at, 1,
+			src, areas[c].step / 8, frames
+		);
+	}
+	snd_pcm_sframes_t committed = snd_pcm_mmap_commit(data->handle,
+		offset, frames
+	);
+	if (committed < 0) return committed;
+	if ((snd_pcm_uframes_t)committed != frames) return -EPIPE;
+	return frames;
+}
+
+
+/** Parses the params json into our data struct. */
+static int parse_params(struct aylp_alsa_capture_data *data,
+	json_object *params
+){
+	json_object_object_foreach(params, key, val) {
+		if (key[0] == '_') {
+			// keys starting with _ are comments
+		} else if (!strcmp(key, "device")) {
+			data->device = json_object_get_string(val);
+			log_trace("device = %s", data->device);
+		} else if (!strcmp(key, "access")) {
+			const char *s = json_object_get_string(val);
+			if (!s) s = "";
+			if (!strcasecmp(s, "MMAP_INTERLEAVED")) {
+				data->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+			} else if (!strcasecmp(s, "MMAP_NONINTERLEAVED")) {
+				data->access =
+					SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+			} else {
+				log_error("Unsupported capture access \"%s\"",
+					s
+				);
+				return -1;
+			}
+			log_trace("access = %s", s);
+		} else if (!strcmp(key, "format")) {
+			const char *s = json_object_get_string(val);
+			data->format = snd_pcm_format_value(s);
+			if (data->format == SND_PCM_FORMAT_UNKNOWN) {
+				log_error("Unknown format \"%s\"", s);
+				return -1;
+			}
+			log_trace("format = %s",
+				snd_pcm_format_name(data->format)
+			);
+		} else if (!strcmp(key, "channels")) {
+			data->channels = json_object_get_int(val);
+			log_trace("channels = %u", data->channels);
+		} else if (!strcmp(key, "rate")) {
+			data->rate = json_object_get_int(val);
+			log_trace("rate = %u", data->rate);
+		} else if (!strcmp(key, "buffer_time")) {
+			data->buffer_time = json_object_get_int(val);
+			log_trace("buffer_time = %u", data->buffer_time);
+		} else if (!strcmp(key, "period_time")) {
+			data->period_time = json_object_get_int(val);
+			log_trace("period_time = %u", data->period_time);
+		} else if (!strcmp(key, "frames")) {
+			data->frames = json_object_get_int(val);
+			log_trace("frames = %lu", data->frames);
+		} else if (!strcmp(key, "mean")) {
+			data->mean = json_object_get_boolean(val);
+			log_trace("mean = %d", data->mean);
+		} else if (!strcmp(key, "skip_stale")) {
+			data->skip_stale = json_object_get_boolean(val);
+			log_trace("skip_stale = %d", data->skip_stale);
+		} else if (!strcmp(key, "link")) {
+			data->link = json_object_get_string(val);
+			log_trace("link = %s", data->link);
+		} else {
+			log_warn("Unknown parameter \"%s\"", key);
+		}
+	}
+	return 0;
+}
+
+
+int aylp_alsa_capture_init(struct aylp_device *self)
+{
+	int err;
+	self->device_data = xcalloc(1, sizeof(struct aylp_alsa_capture_data));
+	struct aylp_alsa_capture_data *data = self->device_data;
+	// attach methods
+	self->process = &aylp_alsa_capture_process;
+	self->close = &aylp_alsa_capture_close;
+
+	// default params
+	data->device = "default";
+	data->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	data->format = SND_PCM_FORMAT_S16;
+	data->channels = 2;
+	data->rate = 48000;
+	data->buffer_time = 0;
+	data->period_time = 0;
+	data->frames = 0;
+	data->mean = false;
+	data->skip_stale = false;
+	data->link = NULL;
+	data->wait_ms = 1000;
+	if (self->params) {
+		err = parse_params(data, self->params);
+		if (err) return err;
+	}
+	if (!data->channels || !data->rate) {
+		log_error("channels and rate must be nonzero");
+		return -1;
+	}
+
+	err = snd_pcm_open(&data->handle, data->device,
+		SND_PCM_STREAM_CAPTURE, 0
+	);
+	if (err < 0) {
+		log_error("Capture open error: %s", snd_strerror(err));
+		return -1;
+	}
+	err = set_params(data);
+	if (err < 0) return -1;
+	if (!data->frames) data->frames = data->period_size;
+	log_info("Capturing %u channels of %s at %u Hz, %lu frames per "
+		"iteration (period %lu, buffer %lu)", data->channels,
+		snd_pcm_format_name(data->format), data->rate, data->frames,
+		data->period_size, data->buffer_size
+	);
+
+	data->phys_bps = snd_pcm_format_physical_width(data->format) / 8;
+	data->deconv = aylp_alsa_deconv_find(
+		snd_pcm_format_width(data->format), data->phys_bps,
+		snd_pcm_format_big_endian(data->format) == 1,
+		snd_pcm_format_unsigned(data->format) == 1,
+		snd_pcm_format_float(data->format) == 1
+	);
+	if (!data->deconv) {
+		log_error("No sample conversion for format %s",
+			snd_pcm_format_name(data->format)
+		);
+		return -1;
+	}
+
+	data->block = gsl_matrix_calloc(data->channels, data->frames);
+	data->vec = gsl_vector_calloc(data->channels);
+
+	// if the playback is already open, link now, while both are prepared;
+	// otherwise we try again on the first process()
+	if (data->link) link_playback(data);
+
+	self->type_in = AYLP_T_ANY;
+	self->units_in = AYLP_U_ANY;
+	self->type_out = data->mean ? AYLP_T_VECTOR : AYLP_T_MATRIX;
+	self->units_out = AYLP_U_MINMAX;
+	return 0;
+}
+
+
+int aylp_alsa_capture_process(struct aylp_device *self,
+	struct aylp_state *state
+){
+	struct aylp_alsa_capture_data *data = self->device_data;
+	int err;
+	if (UNLIKELY(data->link && !data->linked)) {
+		link_playback(data);
+		if (!data->linked) {
+			log_warn("No aylp_alsa playback on %s to link to",
+				data->link
+			);
+			data->link = NULL;
+		}
+	}
+
+	// frames we don't get to keep their old values
+	snd_pcm_uframes_t done = 0;
+	while (done < data->frames) {
+		err = ensure_running(data);
+		if (err < 0) return err;
+		if (err > 0) break;	// not started yet
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(data->handle);
+		if (UNLIKELY(avail < 0)) {
+			err = recover(data, avail);
+			if (err) return err;
+			continue;
+		}
+		snd_pcm_uframes_t room = avail;
+		snd_pcm_uframes_t want = data->frames - done;
+		if (data->skip_stale && !done && room > want) {
+			// drop the backlog so we hand on the newest frames
+			snd_pcm_forward(data->handle, room - want);
+			room = want;
+		}
+		if (!room) {
+			err = snd_pcm_wait(data->handle, data->wait_ms);
+			if (err < 0) {
+				err = recover(data, err);
+				if (err) return err;
+			} else if (!err) {
+				log_warn("Timed out waiting for capture");
+				break;
+			}
+			continue;
+		}
+		snd_pcm_sframes_t n = read_areas(data, done,
+			room < want ? room : want
+		);
+		if (UNLIKELY(n < 0)) {
+			err = recover(data, n);
+			if (err) return err;
+			continue;
+		}
+		done += n;
+	}
+
+	if (data->mean) {
+		// average only what we read; with nothing, keep the last mean
+		for (unsigned c = 0; done && c < data->channels; c++) {
+			const double *row = data->block->data
+				+ c * data->block->tda;
+			double sum = 0.0;
+			for (size_t f = 0; f < done; f++)
+				sum += row[f];
+			gsl_vector_set(data->vec, c, sum / done);
+		}
+		state->vector = data->vec;
+		state->header.type = AYLP_T_VECTOR;
+		state->header.log_dim.y = data->channels;
+		state->header.log_dim.x = 1;
+	} else {
+		state->matrix = data->block;
+		state->header.type = AYLP_T_MATRIX;
+		state->header.log_dim.y = data->channels;
+		state->header.log_dim.x = data->frames;
+	}
+	state->header.units = AYLP_U_MINMAX;
+	return 0;
+}
+
+
+int aylp_alsa_capture_close(struct aylp_device *self)
+{
+	struct aylp_alsa_capture_data *data = self->device_data;
+	if (data->handle) {
+		if (data->linked) snd_pcm_unlink(data->handle);
+		snd_pcm_close(data->handle);
+	}
+	log_info("Capture: %llu overruns", data->xruns);
+	if (data->block) gsl_matrix_free(data->block);
+	if (data->vec) gsl_vector_free(data->vec);
+	xfree(self->device_data);
+	return 0;
+}
+
@@ -0,0 +1,59 @@
+#ifndef AYLP_ALSA_CAPTURE_H_
+#define AYLP_ALSA_CAPTURE_H_
+
+#include <alsa/asoundlib.h>
+
+#include "anyloop.h"
+#include "aylp_alsa_conv.h"
+
+struct aylp_alsa_capture_data {
+	snd_pcm_t *handle;
+	// capture device from `arecord -L` (e.g. "hw:0")
+	const char *device;
+	// read access method (MMAP_INTERLEAVED or MMAP_NONINTERLEAVED)
+	snd_pcm_access_t access;
+	snd_pcm_format_t format;
+	unsigned channels;
+	unsigned rate;
+	// requested buffer and period time [us]; 0 lets the device choose
+	unsigned buffer_time;
+	unsigned period_time;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+	// frames read per process() call (0 means one period)
+	snd_pcm_uframes_t frames;
+	// if true, output the per-channel mean as a vector instead of the
+	// whole channels x frames block as a matrix
+	bool mean;
+	// if true, skip to the newest frames instead of reading a backlog
+	bool skip_stale;
+	// playback device of an aylp_alsa instance to start and stop with,
+	// or NULL
+	const char *link;
+	// if we've linked to it yet
+	bool linked;
+	// timeout for snd_pcm_wait() [ms]
+	int wait_ms;
+	// sample conversion kernel for our format
+	aylp_alsa_deconv_fn deconv;
+	int phys_bps;
+	// what we output
+	gsl_matrix *block;
+	gsl_vector *vec;
+	// xruns we've recovered from
+	unsigned long long xruns;
+};
+
+// initialize alsa capture device
+int aylp_alsa_capture_init(struct aylp_device *self);
+
+// read a block from alsa into the pipeline
+int aylp_alsa_capture_process(struct aylp_device *self,
+	struct aylp_state *state
+);
+
+// close alsa capture device when loop exits
+int aylp_alsa_capture_close(struct aylp_device *self);
+
+#endif
+
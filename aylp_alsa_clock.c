@@ -0,0 +1,51 @@
+#include "aylp_alsa_clock.h"
+
+
+void aylp_alsa_clock_init(struct aylp_alsa_clock *clk, unsigned rate,
+	long long interval_ns, double alpha
+){
+	clk->rate = rate;
+	clk->interval_ns = interval_ns;
+	clk->alpha = alpha;
+	clk->ratio = 1.0;
+	clk->n = 0;
+	clk->delay_frames = 0;
+	clk->delay_s = 0.0;
+	aylp_alsa_clock_reset(clk);
+}
+
+
+void aylp_alsa_clock_reset(struct aylp_alsa_clock *clk)
+{
+	clk->have_ref = false;
+}
+
+
+void aylp_alsa_clock_update(struct aylp_alsa_clock *clk, uint64_t written,
+	long long delay, long long tstamp_ns
+){
+	if (delay < 0) delay = 0;
+	if ((uint64_t)delay > written) return;
+	uint64_t played = written - delay;
+	clk->delay_frames = delay;
+	clk->delay_s = delay / (clk->rate * clk->ratio);
+	if (!clk->have_ref) {
+		clk->ref_played = played;
+		clk->ref_ns = tstamp_ns;
+		clk->have_ref = true;
+		return;
+	}
+	long long dt = tstamp_ns - clk->ref_ns;
+	if (dt < clk->interval_ns) return;
+	double r = (double)(played - clk->ref_played) / clk->rate
+		/ (dt * 1e-9);
+	// the first measurement is all we have; after that, smooth
+	if (clk->n++) {
+		clk->ratio += clk->alpha * (r - clk->ratio);
+	} else {
+		clk->ratio = r;
+	}
+	clk->ref_played = played;
+	clk->ref_ns = tstamp_ns;
+}
+
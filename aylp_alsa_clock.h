@@ -0,0 +1,49 @@
+// sound card clock drift and output delay estimation for aylp_alsa
+#ifndef AYLP_ALSA_CLOCK_H_
+#define AYLP_ALSA_CLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Tracks the card's sample clock against CLOCK_MONOTONIC. Each reading pairs
+ * the number of frames the card has played with the timestamp ALSA took at
+ * that hw pointer position. Over every interval of at least interval_ns, the
+ * frames played divided by the nominal rate and the elapsed time gives one
+ * ratio measurement, which we smooth with a one-pole filter.
+ */
+struct aylp_alsa_clock {
+	// nominal sample rate [Hz]
+	unsigned rate;
+	// shortest interval we measure the ratio over [ns]
+	long long interval_ns;
+	// weight of each new ratio measurement, in (0, 1]
+	double alpha;
+	// start of the current interval
+	bool have_ref;
+	uint64_t ref_played;
+	long long ref_ns;
+	// card rate / nominal rate, or 1.0 until we've measured it
+	double ratio;
+	// number of ratio measurements so far
+	uint64_t n;
+	// output delay at the last reading [frames] and [s]
+	long long delay_frames;
+	double delay_s;
+};
+
+void aylp_alsa_clock_init(struct aylp_alsa_clock *clk, unsigned rate,
+	long long interval_ns, double alpha
+);
+
+// forget the current interval, e.g. after an xrun drops frames
+void aylp_alsa_clock_reset(struct aylp_alsa_clock *clk);
+
+/** Adds a reading: `written` frames committed in total, `delay` frames still
+ * queued, and the CLOCK_MONOTONIC time [ns] of the hw pointer reading.
+ */
+void aylp_alsa_clock_update(struct aylp_alsa_clock *clk, uint64_t written,
+	long long delay, long long tstamp_ns
+);
+
+#endif
+
@@ -0,0 +1,469 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "aylp_alsa_conv.h"
+
+// GNU vector extensions give us SIMD on whatever the target has (SSE, AVX,
+// NEON, ...); everything else gets the scalar loops
+#if defined(__GNUC__)
+#define CONV_SIMD 1
+#define CONV_VLEN 4
+typedef double v_dbl __attribute__((vector_size(CONV_VLEN * sizeof(double))));
+typedef int64_t v_i64 __attribute__((vector_size(CONV_VLEN * sizeof(int64_t))));
+typedef int32_t v_i32 __attribute__((vector_size(CONV_VLEN * sizeof(int32_t))));
+#else
+#define CONV_SIMD 0
+#endif
+
+
+/* Byte stores. These are written bytewise so they don't care about host
+ * endianness or alignment; the compiler merges them into single (byteswapped
+ * if need be) stores.
+ */
+static inline void st8(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+}
+static inline void st16le(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8;
+}
+static inline void st16be(unsigned char *p, uint32_t v)
+{
+	p[1] = v; p[0] = v >> 8;
+}
+static inline void st24le(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16;
+}
+static inline void st24be(unsigned char *p, uint32_t v)
+{
+	p[2] = v; p[1] = v >> 8; p[0] = v >> 16;
+}
+static inline void st32le(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+static inline void st32be(unsigned char *p, uint32_t v)
+{
+	p[3] = v; p[2] = v >> 8; p[1] = v >> 16; p[0] = v >> 24;
+}
+static inline void st64le(unsigned char *p, uint64_t v)
+{
+	st32le(p, v); st32le(p + 4, v >> 32);
+}
+static inline void st64be(unsigned char *p, uint64_t v)
+{
+	st32be(p + 4, v); st32be(p, v >> 32);
+}
+static inline void stf32le(unsigned char *p, double f)
+{
+	float g = f; uint32_t v; memcpy(&v, &g, sizeof v); st32le(p, v);
+}
+static inline void stf32be(unsigned char *p, double f)
+{
+	float g = f; uint32_t v; memcpy(&v, &g, sizeof v); st32be(p, v);
+}
+static inline void stf64le(unsigned char *p, double f)
+{
+	uint64_t v; memcpy(&v, &f, sizeof v); st64le(p, v);
+}
+static inline void stf64be(unsigned char *p, double f)
+{
+	uint64_t v; memcpy(&v, &f, sizeof v); st64be(p, v);
+}
+
+
+static inline double clamp(double f)
+{
+	// written so that NaN comes out as 0
+	if (f > 1.0) return 1.0;
+	if (f >= -1.0) return f;
+	if (f < -1.0) return -1.0;
+	return 0.0;
+}
+
+#if CONV_SIMD
+/** Gathers CONV_VLEN samples from src and clamps them to [-1, 1]. */
+static inline void vload(v_dbl *out, const double *restrict src,
+	size_t stride
+){
+	v_dbl x;
+	if (stride == 1) {
+		memcpy(&x, src, sizeof x);
+	} else {
+		for (int k = 0; k < CONV_VLEN; k++) x[k] = src[k*stride];
+	}
+	const v_dbl one = {1.0, 1.0, 1.0, 1.0};
+	v_i64 hi = x > one;
+	v_i64 lo = x < -one;
+	v_i64 nan = x != x;
+	v_i64 xi = (v_i64)x;
+	xi = (xi & ~hi) | ((v_i64)one & hi);
+	xi = (xi & ~lo) | ((v_i64)(-one) & lo);
+	xi &= ~nan;
+	*out = (v_dbl)xi;
+}
+#endif
+
+
+/** Copies the sample at dst to the n-1 samples after it, step bytes apart. */
+static void replicate(unsigned char *restrict dst, size_t step, size_t bps,
+	size_t n
+){
+	if (step == bps) {
+		// contiguous, so double the filled region with each memcpy
+		size_t total = n * bps, filled = bps;
+		while (filled < total) {
+			size_t chunk = filled < total - filled
+				? filled : total - filled;
+			memcpy(dst + filled, dst, chunk);
+			filled += chunk;
+		}
+	} else {
+		for (size_t i = 1; i < n; i++)
+			memcpy(dst + i*step, dst, bps);
+	}
+}
+
+/* Each kernel is a body that's inlined into a few specializations: a held
+ * value is encoded once and replicated, and contiguous (planar) destinations
+ * get a constant step so the stores vectorize.
+ */
+#define KERNEL_DISPATCH(name, bps) \
+static void name(unsigned char *restrict dst, size_t step, \
+	const double *restrict src, size_t stride, size_t n) \
+{ \
+	if (!n) return; \
+	if (stride == 0) { \
+		name##_body(dst, step, src, 1, 1); \
+		replicate(dst, step, (bps), n); \
+	} else if (step == (bps) && stride == 1) { \
+		name##_body(dst, (bps), src, 1, n); \
+	} else if (step == (bps)) { \
+		name##_body(dst, (bps), src, stride, n); \
+	} else { \
+		name##_body(dst, step, src, stride, n); \
+	} \
+}
+
+/* Integer kernels. We keep the plugin's historical scaling of half of full
+ * scale, i.e. an input of 1.0 maps to maxval/2. Unsigned formats are offset so
+ * that 0.0 lands on the midpoint code.
+ */
+#if CONV_SIMD
+#define INT_KERNEL_SIMD(store, offset) \
+	for (; i + CONV_VLEN <= n; i += CONV_VLEN) { \
+		v_dbl x; \
+		vload(&x, src + i*stride, stride); \
+		x *= scale; \
+		v_i32 q = __builtin_convertvector(x, v_i32); \
+		for (int k = 0; k < CONV_VLEN; k++) \
+			store(dst + (i+k)*step, (uint32_t)q[k] + (offset)); \
+	}
+#else
+#define INT_KERNEL_SIMD(store, offset)
+#endif
+
+#define INT_KERNEL(name, bits, bps, offset, store) \
+static inline __attribute__((always_inline)) void name##_body( \
+	unsigned char *restrict dst, size_t step, \
+	const double *restrict src, size_t stride, size_t n) \
+{ \
+	const double scale = (double)((UINT32_C(1) << ((bits) - 1)) - 1) / 2; \
+	size_t i = 0; \
+	INT_KERNEL_SIMD(store, offset) \
+	for (; i < n; i++) { \
+		int32_t q = clamp(src[i*stride]) * scale; \
+		store(dst + i*step, (uint32_t)q + (offset)); \
+	} \
+} \
+KERNEL_DISPATCH(name, bps)
+
+#if CONV_SIMD
+#define FLOAT_KERNEL_SIMD(store) \
+	for (; i + CONV_VLEN <= n; i += CONV_VLEN) { \
+		v_dbl x; \
+		vload(&x, src + i*stride, stride); \
+		x *= 0.5; \
+		for (int k = 0; k < CONV_VLEN; k++) \
+			store(dst + (i+k)*step, x[k]); \
+	}
+#else
+#define FLOAT_KERNEL_SIMD(store)
+#endif
+
+#define FLOAT_KERNEL(name, bps, store) \
+static inline __attribute__((always_inline)) void name##_body( \
+	unsigned char *restrict dst, size_t step, \
+	const double *restrict src, size_t stride, size_t n) \
+{ \
+	size_t i = 0; \
+	FLOAT_KERNEL_SIMD(store) \
+	for (; i < n; i++) \
+		store(dst + i*step, clamp(src[i*stride]) * 0.5); \
+} \
+KERNEL_DISPATCH(name, bps)
+
+INT_KERNEL(conv_s8, 8, 1, 0, st8)
+INT_KERNEL(conv_u8, 8, 1, UINT32_C(1) << 7, st8)
+INT_KERNEL(conv_s16le, 16, 2, 0, st16le)
+INT_KERNEL(conv_s16be, 16, 2, 0, st16be)
+INT_KERNEL(conv_u16le, 16, 2, UINT32_C(1) << 15, st16le)
+INT_KERNEL(conv_u16be, 16, 2, UINT32_C(1) << 15, st16be)
+// 24 bits in a 4-byte container; sign extension fills the high byte
+INT_KERNEL(conv_s24le, 24, 4, 0, st32le)
+INT_KERNEL(conv_s24be, 24, 4, 0, st32be)
+INT_KERNEL(conv_u24le, 24, 4, UINT32_C(1) << 23, st32le)
+INT_KERNEL(conv_u24be, 24, 4, UINT32_C(1) << 23, st32be)
+// packed 24 bits
+INT_KERNEL(conv_s24_3le, 24, 3, 0, st24le)
+INT_KERNEL(conv_s24_3be, 24, 3, 0, st24be)
+INT_KERNEL(conv_u24_3le, 24, 3, UINT32_C(1) << 23, st24le)
+INT_KERNEL(conv_u24_3be, 24, 3, UINT32_C(1) << 23, st24be)
+INT_KERNEL(conv_s32le, 32, 4, 0, st32le)
+INT_KERNEL(conv_s32be, 32, 4, 0, st32be)
+INT_KERNEL(conv_u32le, 32, 4, UINT32_C(1) << 31, st32le)
+INT_KERNEL(conv_u32be, 32, 4, UINT32_C(1) << 31, st32be)
+FLOAT_KERNEL(conv_f32le, 4, stf32le)
+FLOAT_KERNEL(conv_f32be, 4, stf32be)
+FLOAT_KERNEL(conv_f64le, 8, stf64le)
+FLOAT_KERNEL(conv_f64be, 8, stf64be)
+
+
+/* Loads, the inverses of the stores above. */
+static inline uint32_t ld8(const unsigned char *p)
+{
+	return p[0];
+}
+static inline uint32_t ld16le(const unsigned char *p)
+{
+	return p[0] | (uint32_t)p[1] << 8;
+}
+static inline uint32_t ld16be(const unsigned char *p)
+{
+	return p[1] | (uint32_t)p[0] << 8;
+}
+static inline uint32_t ld24le(const unsigned char *p)
+{
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+}
+static inline uint32_t ld24be(const unsigned char *p)
+{
+	return p[2] | (uint32_t)p[1] << 8 | (uint32_t)p[0] << 16;
+}
+static inline uint32_t ld32le(const unsigned char *p)
+{
+	return ld16le(p) | ld16le(p + 2) << 16;
+}
+static inline uint32_t ld32be(const unsigned char *p)
+{
+	return ld16be(p + 2) | ld16be(p) << 16;
+}
+static inline uint64_t ld64le(const unsigned char *p)
+{
+	return ld32le(p) | (uint64_t)ld32le(p + 4) << 32;
+}
+static inline uint64_t ld64be(const unsigned char *p)
+{
+	return ld32be(p + 4) | (uint64_t)ld32be(p) << 32;
+}
+static inline double ldf32le(const unsigned char *p)
+{
+	uint32_t v = ld32le(p); float g; memcpy(&g, &v, sizeof g); return g;
+}
+static inline double ldf32be(const unsigned char *p)
+{
+	uint32_t v = ld32be(p); float g; memcpy(&g, &v, sizeof g); return g;
+}
+static inline double ldf64le(const unsigned char *p)
+{
+	uint64_t v = ld64le(p); double f; memcpy(&f, &v, sizeof f); return f;
+}
+static inline double ldf64be(const unsigned char *p)
+{
+	uint64_t v = ld64be(p); double f; memcpy(&f, &v, sizeof f); return f;
+}
+
+// removes the unsigned offset and sign-extends from `bits` bits
+static inline int32_t sext(uint32_t v, uint32_t offset, int bits)
+{
+	return (int32_t)((v - offset) << (32 - bits)) >> (32 - bits);
+}
+
+#if CONV_SIMD
+/** Scatters CONV_VLEN samples to dst. */
+static inline void vstore(double *restrict dst, size_t stride, const v_dbl *x)
+{
+	if (stride == 1) {
+		memcpy(dst, x, sizeof *x);
+	} else {
+		for (int k = 0; k < CONV_VLEN; k++) dst[k*stride] = (*x)[k];
+	}
+}
+#endif
+
+/* Capture kernels, which undo the playback scaling exactly, so a full-scale
+ * input comes out as +-2.0. Like the playback kernels, contiguous sources get
+ * a constant step so the loads vectorize.
+ */
+#define DECONV_DISPATCH(name, bps) \
+static void name(double *restrict dst, size_t stride, \
+	const unsigned char *restrict src, size_t step, size_t n) \
+{ \
+	if (step == (bps) && stride == 1) { \
+		name##_body(dst, 1, src, (bps), n); \
+	} else if (step == (bps)) { \
+		name##_body(dst, stride, src, (bps), n); \
+	} else { \
+		name##_body(dst, stride, src, step, n); \
+	} \
+}
+
+#if CONV_SIMD
+#define INT_DECONV_SIMD(bits, offset, load) \
+	for (; i + CONV_VLEN <= n; i += CONV_VLEN) { \
+		v_i32 q; \
+		for (int k = 0; k < CONV_VLEN; k++) \
+			q[k] = sext(load(src + (i+k)*step), (offset), (bits)); \
+		v_dbl x = __builtin_convertvector(q, v_dbl) * scale; \
+		vstore(dst + i*stride, stride, &x); \
+	}
+#else
+#define INT_DECONV_SIMD(bits, offset, load)
+#endif
+
+#define INT_DECONV(name, bits, bps, offset, load) \
+static inline __attribute__((always_inline)) void name##_body( \
+	double *restrict dst, size_t stride, \
+	const unsigned char *restrict src, size_t step, size_t n) \
+{ \
+	const double scale = 2 / (double)((UINT32_C(1) << ((bits) - 1)) - 1); \
+	size_t i = 0; \
+	INT_DECONV_SIMD(bits, offset, load) \
+	for (; i < n; i++) \
+		dst[i*stride] = sext(load(src + i*step), (offset), (bits)) \
+			* scale; \
+} \
+DECONV_DISPATCH(name, bps)
+
+#if CONV_SIMD
+#define FLOAT_DECONV_SIMD(load) \
+	for (; i + CONV_VLEN <= n; i += CONV_VLEN) { \
+		v_dbl x; \
+		for (int k = 0; k < CONV_VLEN; k++) \
+			x[k] = load(src + (i+k)*step); \
+		x *= 2.0; \
+		vstore(dst + i*stride, stride, &x); \
+	}
+#else
+#define FLOAT_DECONV_SIMD(load)
+#endif
+
+#define FLOAT_DECONV(name, bps, load) \
+static inline __attribute__((always_inline)) void name##_body( \
+	double *restrict dst, size_t stride, \
+	const unsigned char *restrict src, size_t step, size_t n) \
+{ \
+	size_t i = 0; \
+	FLOAT_DECONV_SIMD(load) \
+	for (; i < n; i++) \
+		dst[i*stride] = load(src + i*step) * 2.0; \
+} \
+DECONV_DISPATCH(name, bps)
+
+INT_DECONV(deconv_s8, 8, 1, 0, ld8)
+INT_DECONV(deconv_u8, 8, 1, UINT32_C(1) << 7, ld8)
+INT_DECONV(deconv_s16le, 16, 2, 0, ld16le)
+INT_DECONV(deconv_s16be, 16, 2, 0, ld16be)
+INT_DECONV(deconv_u16le, 16, 2, UINT32_C(1) << 15, ld16le)
+INT_DECONV(deconv_u16be, 16, 2, UINT32_C(1) << 15, ld16be)
+// the high byte of a 4-byte container is ignored
+INT_DECONV(deconv_s24le, 24, 4, 0, ld32le)
+INT_DECONV(deconv_s24be, 24, 4, 0, ld32be)
+INT_DECONV(deconv_u24le, 24, 4, UINT32_C(1) << 23, ld32le)
+INT_DECONV(deconv_u24be, 24, 4, UINT32_C(1) << 23, ld32be)
+INT_DECONV(deconv_s24_3le, 24, 3, 0, ld24le)
+INT_DECONV(deconv_s24_3be, 24, 3, 0, ld24be)
+INT_DECONV(deconv_u24_3le, 24, 3, UINT32_C(1) << 23, ld24le)
+INT_DECONV(deconv_u24_3be, 24, 3, UINT32_C(1) << 23, ld24be)
+INT_DECONV(deconv_s32le, 32, 4, 0, ld32le)
+INT_DECONV(deconv_s32be, 32, 4, 0, ld32be)
+INT_DECONV(deconv_u32le, 32, 4, UINT32_C(1) << 31, ld32le)
+INT_DECONV(deconv_u32be, 32, 4, UINT32_C(1) << 31, ld32be)
+FLOAT_DECONV(deconv_f32le, 4, ldf32le)
+FLOAT_DECONV(deconv_f32be, 4, ldf32be)
+FLOAT_DECONV(deconv_f64le, 8, ldf64le)
+FLOAT_DECONV(deconv_f64be, 8, ldf64be)
+
+static const struct {
+	int format_bits;
+	int phys_bps;
+	bool big_endian;
+	bool to_unsigned;
+	bool is_float;
+	aylp_alsa_conv_fn fn;
+	aylp_alsa_deconv_fn inv;
+} conv_table[] = {
+	// endianness is ignored for 8-bit formats
+	{ 8, 1, false, false, false, conv_s8, deconv_s8},
+	{ 8, 1, false, true,  false, conv_u8, deconv_u8},
+	{16, 2, false, false, false, conv_s16le, deconv_s16le},
+	{16, 2, true,  false, false, conv_s16be, deconv_s16be},
+	{16, 2, false, true,  false, conv_u16le, deconv_u16le},
+	{16, 2, true,  true,  false, conv_u16be, deconv_u16be},
+	{24, 4, false, false, false, conv_s24le, deconv_s24le},
+	{24, 4, true,  false, false, conv_s24be, deconv_s24be},
+	{24, 4, false, true,  false, conv_u24le, deconv_u24le},
+	{24, 4, true,  true,  false, conv_u24be, deconv_u24be},
+	{24, 3, false, false, false, conv_s24_3le, deconv_s24_3le},
+	{24, 3, true,  false, false, conv_s24_3be, deconv_s24_3be},
+	{24, 3, false, true,  false, conv_u24_3le, deconv_u24_3le},
+	{24, 3, true,  true,  false, conv_u24_3be, deconv_u24_3be},
+	{32, 4, false, false, false, conv_s32le, deconv_s32le},
+	{32, 4, true,  false, false, conv_s32be, deconv_s32be},
+	{32, 4, false, true,  false, conv_u32le, deconv_u32le},
+	{32, 4, true,  true,  false, conv_u32be, deconv_u32be},
+	{32, 4, false, false, true,  conv_f32le, deconv_f32le},
+	{32, 4, true,  false, true,  conv_f32be, deconv_f32be},
+	{64, 8, false, false, true,  conv_f64le, deconv_f64le},
+	{64, 8, true,  false, true,  conv_f64be, deconv_f64be},
+};
+
+
+static int conv_index(int format_bits, int phys_bps, bool big_endian,
+	bool to_unsigned, bool is_float
+){
+	if (phys_bps == 1) big_endian = false;
+	if (is_float) to_unsigned = false;
+	for (size_t i = 0; i < sizeof conv_table / sizeof conv_table[0]; i++) {
+		if (conv_table[i].format_bits == format_bits
+		&& conv_table[i].phys_bps == phys_bps
+		&& conv_table[i].big_endian == big_endian
+		&& conv_table[i].to_unsigned == to_unsigned
+		&& conv_table[i].is_float == is_float)
+			return i;
+	}
+	return -1;
+}
+
+
+aylp_alsa_conv_fn aylp_alsa_conv_find(int format_bits, int phys_bps,
+	bool big_endian, bool to_unsigned, bool is_float
+){
+	int i = conv_index(format_bits, phys_bps, big_endian, to_unsigned,
+		is_float
+	);
+	return i < 0 ? NULL : conv_table[i].fn;
+}
+
+
+aylp_alsa_deconv_fn aylp_alsa_deconv_find(int format_bits, int phys_bps,
+	bool big_endian, bool from_unsigned, bool is_float
+){
+	int i = conv_index(format_bits, phys_bps, big_endian, from_unsigned,
+		is_float
+	);
+	return i < 0 ? NULL : conv_table[i].inv;
+}
+
@@ -0,0 +1,40 @@
+// sample conversion kernels for aylp_alsa
+#ifndef AYLP_ALSA_CONV_H_
+#define AYLP_ALSA_CONV_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Converts n samples from doubles into the card's native format.
+ * Input is in AYLP_U_MINMAX units and is clamped to [-1, 1]. src is read every
+ * `stride` doubles (a stride of 0 repeats src[0]), and dst is advanced by
+ * `step` bytes after each sample.
+ */
+typedef void (*aylp_alsa_conv_fn)(unsigned char *restrict dst, size_t step,
+	const double *restrict src, size_t stride, size_t n
+);
+
+/** Returns the conversion kernel for a sample format, or NULL if there is none.
+ * Arguments are as returned by snd_pcm_format_width(),
+ * snd_pcm_format_physical_width()/8, snd_pcm_format_big_endian(),
+ * snd_pcm_format_unsigned(), and snd_pcm_format_float().
+ */
+aylp_alsa_conv_fn aylp_alsa_conv_find(int format_bits, int phys_bps,
+	bool big_endian, bool to_unsigned, bool is_float
+);
+
+/** Converts n samples from the card's native format into doubles, undoing the
+ * scaling of aylp_alsa_conv_fn (so a full-scale sample comes out as +-2.0).
+ * src is advanced by `step` bytes and dst by `stride` doubles per sample.
+ */
+typedef void (*aylp_alsa_deconv_fn)(double *restrict dst, size_t stride,
+	const unsigned char *restrict src, size_t step, size_t n
+);
+
+// like aylp_alsa_conv_find(), but for capture
+aylp_alsa_deconv_fn aylp_alsa_deconv_find(int format_bits, int phys_bps,
+	bool big_endian, bool from_unsigned, bool is_float
+);
+
+#endif
+
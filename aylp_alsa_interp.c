@@ -0,0 +1,130 @@
+#include <math.h>
+#include <string.h>
+
+#include "xalloc.h"
+#include "aylp_alsa_interp.h"
+
+
+static double sinc(double x)
+{
+	if (fabs(x) < 1e-12) return 1.0;
+	return sin(M_PI * x) / (M_PI * x);
+}
+
+// Blackman window over [-1, 1]
+static double blackman(double x)
+{
+	if (fabs(x) >= 1.0) return 0.0;
+	return 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2 * M_PI * x);
+}
+
+
+/** Fills the coefficient table for output frame j at fraction t in (0, 1]. */
+static void fill_coefs(struct aylp_alsa_interp *ip, size_t j, double t)
+{
+	double *h = ip->coefs + j * ip->taps;
+	unsigned T = ip->taps;
+	switch (ip->kind) {
+	case AYLP_ALSA_INTERP_LINEAR:
+		h[T-2] = 1.0 - t;
+		h[T-1] = t;
+		break;
+	case AYLP_ALSA_INTERP_CUBIC: {
+		// Hermite from p1 to p2 with tangents (p2-p0)/2 and (p2-p1),
+		// written out in terms of p0, p1, p2
+		double t2 = t*t, t3 = t2*t;
+		double h00 = 2*t3 - 3*t2 + 1;
+		double h10 = t3 - 2*t2 + t;
+		double h01 = -2*t3 + 3*t2;
+		double h11 = t3 - t2;
+		h[T-3] = -h10 / 2;
+		h[T-2] = h00 - h11;
+		h[T-1] = h10 / 2 + h01 + h11;
+		break;
+	}
+	case AYLP_ALSA_INTERP_SINC: {
+		// output sits between hist[T/2-1] and hist[T/2]
+		double pos = T/2 - 1 + t;
+		double sum = 0.0;
+		for (unsigned k = 0; k < T; k++) {
+			double x = pos - k;
+			h[k] = sinc(x) * blackman(x / (T/2));
+			sum += h[k];
+		}
+		// unity gain at DC
+		for (unsigned k = 0; k < T; k++) h[k] /= sum;
+		break;
+	}
+	case AYLP_ALSA_INTERP_NONE:
+	default:
+		h[T-1] = 1.0;
+		break;
+	}
+}
+
+
+void aylp_alsa_interp_init(struct aylp_alsa_interp *ip,
+	enum aylp_alsa_interp_kind kind, unsigned channels, size_t frames,
+	unsigned taps
+){
+	ip->kind = kind;
+	ip->channels = channels;
+	ip->frames = frames;
+	switch (kind) {
+	case AYLP_ALSA_INTERP_LINEAR: ip->taps = 2; break;
+	case AYLP_ALSA_INTERP_CUBIC: ip->taps = 3; break;
+	case AYLP_ALSA_INTERP_SINC: ip->taps = taps < 2 ? 2 : taps & ~1U; break;
+	case AYLP_ALSA_INTERP_NONE:
+	default: ip->taps = 1; break;
+	}
+	ip->hist = xcalloc(ip->taps * channels, sizeof(double));
+	ip->coefs = xcalloc(frames * ip->taps, sizeof(double));
+	ip->out = xcalloc(frames * channels, sizeof(double));
+	ip->primed = false;
+	// the last frame lands on t = 1 so that linear and cubic reach the
+	// current value exactly
+	for (size_t j = 0; j < frames; j++)
+		fill_coefs(ip, j, (double)(j + 1) / frames);
+}
+
+
+void aylp_alsa_interp_free(struct aylp_alsa_interp *ip)
+{
+	xfree(ip->hist);
+	xfree(ip->coefs);
+	xfree(ip->out);
+	ip->hist = ip->coefs = ip->out = NULL;
+}
+
+
+void aylp_alsa_interp_run(struct aylp_alsa_interp *ip, const double *x,
+	size_t stride
+){
+	const unsigned C = ip->channels;
+	const unsigned T = ip->taps;
+	double *restrict hist = ip->hist;
+	// shift the history and append x
+	if (!ip->primed) {
+		for (unsigned k = 0; k < T; k++) {
+			for (unsigned c = 0; c < C; c++)
+				hist[k*C + c] = x[c * stride];
+		}
+		ip->primed = true;
+	} else {
+		memmove(hist, hist + C, (T - 1) * C * sizeof(double));
+		for (unsigned c = 0; c < C; c++)
+			hist[(T-1)*C + c] = x[c * stride];
+	}
+	// y[j][c] = sum_k h[j][k] * hist[k][c]
+	for (size_t j = 0; j < ip->frames; j++) {
+		const double *restrict h = ip->coefs + j * T;
+		double *restrict y = ip->out + j * C;
+		for (unsigned c = 0; c < C; c++) y[c] = 0.0;
+		for (unsigned k = 0; k < T; k++) {
+			if (h[k] == 0.0) continue;
+			const double *restrict hk = hist + k * C;
+			for (unsigned c = 0; c < C; c++) y[c] += h[k] * hk[c];
+		}
+	}
+}
+
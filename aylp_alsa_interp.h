@@ -0,0 +1,59 @@
+// reconstruction between successive pipeline values for aylp_alsa
+#ifndef AYLP_ALSA_INTERP_H_
+#define AYLP_ALSA_INTERP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum aylp_alsa_interp_kind {
+	// hold each value flat (zero-order hold)
+	AYLP_ALSA_INTERP_NONE,
+	// straight line from the previous value to the current one
+	AYLP_ALSA_INTERP_LINEAR,
+	// cubic Hermite through the last three values
+	AYLP_ALSA_INTERP_CUBIC,
+	// windowed-sinc polyphase upsampler; delays by taps/2 values
+	AYLP_ALSA_INTERP_SINC,
+};
+
+/* Every kind is run as a polyphase FIR over the last `taps` input values, with
+ * one set of coefficients per output frame. The inner loop runs across
+ * channels, so it vectorizes however many channels there are.
+ */
+struct aylp_alsa_interp {
+	enum aylp_alsa_interp_kind kind;
+	unsigned channels;
+	// output frames per input value
+	size_t frames;
+	// input values we filter over
+	unsigned taps;
+	// input history, taps x channels, oldest first
+	double *hist;
+	// coefficients, frames x taps
+	double *coefs;
+	// output, frames x channels (frame-major)
+	double *out;
+	// false until the first value has filled the history
+	bool primed;
+};
+
+/** Sets up an interpolator that renders `frames` output frames per input.
+ * taps is only used for AYLP_ALSA_INTERP_SINC and must be even.
+ */
+void aylp_alsa_interp_init(struct aylp_alsa_interp *ip,
+	enum aylp_alsa_interp_kind kind, unsigned channels, size_t frames,
+	unsigned taps
+);
+
+// free what aylp_alsa_interp_init() allocated
+void aylp_alsa_interp_free(struct aylp_alsa_interp *ip);
+
+/** Pushes a new input value and renders the next ip->frames frames to ip->out.
+ * x has ip->channels elements, `stride` doubles apart.
+ */
+void aylp_alsa_interp_run(struct aylp_alsa_interp *ip, const double *x,
+	size_t stride
+);
+
+#endif
+
@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+
+#include "logging.h"
+#include "xalloc.h"
+#include "aylp_alsa_probe.h"
+
+// rates we look for a stable period at, if the device supports them
+static const unsigned std_rates[] = {
+	8000, 16000, 22050, 32000, 44100, 48000, 88200, 96000,
+	176400, 192000, 352800, 384000,
+};
+// smallest and largest periods we try [frames]
+#define PROBE_MIN_PERIOD 16
+#define PROBE_MAX_PERIOD 8192
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/** Adds a [min, max] pair to obj under key. */
+static void add_range(json_object *obj, const char *key,
+	unsigned long long min, unsigned long long max
+){
+	json_object *range = json_object_new_array();
+	json_object_array_add(range, json_object_new_uint64(min));
+	json_object_array_add(range, json_object_new_uint64(max));
+	json_object_object_add(obj, key, range);
+}
+
+
+/** Adds everything the device could be configured for to root. */
+static void describe(snd_pcm_t *handle, snd_pcm_hw_params_t *hw,
+	json_object *root
+){
+	json_object *accesses = json_object_new_array();
+	for (int a = 0; a <= SND_PCM_ACCESS_LAST; a++) {
+		if (!snd_pcm_hw_params_test_access(handle, hw, a)) {
+			json_object_array_add(accesses, json_object_new_string(
+				snd_pcm_access_name(a)
+			));
+		}
+	}
+	json_object_object_add(root, "accesses", accesses);
+
+	json_object *formats = json_object_new_array();
+	for (int f = 0; f <= SND_PCM_FORMAT_LAST; f++) {
+		if (!snd_pcm_format_name(f)) continue;
+		if (!snd_pcm_hw_params_test_format(handle, hw, f)) {
+			json_object_array_add(formats, json_object_new_string(
+				snd_pcm_format_name(f)
+			));
+		}
+	}
+	json_object_object_add(root, "formats", formats);
+
+	unsigned umin = 0, umax = 0;
+	snd_pcm_uframes_t fmin = 0, fmax = 0;
+	int dir = 0;
+	snd_pcm_hw_params_get_channels_min(hw, &umin);
+	snd_pcm_hw_params_get_channels_max(hw, &umax);
+	add_range(root, "channels", umin, umax);
+	snd_pcm_hw_params_get_rate_min(hw, &umin, &dir);
+	snd_pcm_hw_params_get_rate_max(hw, &umax, &dir);
+	add_range(root, "rate", umin, umax);
+	snd_pcm_hw_params_get_period_size_min(hw, &fmin, &dir);
+	snd_pcm_hw_params_get_period_size_max(hw, &fmax, &dir);
+	add_range(root, "period_size", fmin, fmax);
+	snd_pcm_hw_params_get_buffer_size_min(hw, &fmin);
+	snd_pcm_hw_params_get_buffer_size_max(hw, &fmax);
+	add_range(root, "buffer_size", fmin, fmax);
+
+	json_object *rates = json_object_new_array();
+	for (size_t i = 0; i < LEN(std_rates); i++) {
+		if (!snd_pcm_hw_params_test_rate(handle, hw, std_rates[i], 0))
+			json_object_array_add(rates,
+				json_object_new_uint64(std_rates[i])
+			);
+	}
+	json_object_object_add(root, "rates", rates);
+}
+
+
+/** Plays silence with a period near `period` and two periods per buffer for
+ * probe->run_ms, and reports the period and buffer we got in `got`.
+ * Returns 1 if there were no xruns, 0 if there were, or -1 if the device
+ * can't be set up that way.
+ */
+static int try_period(const struct aylp_alsa_probe *probe, unsigned rate,
+	snd_pcm_uframes_t period, struct aylp_alsa_profile *got
+){
+	snd_pcm_t *handle;
+	int err = snd_pcm_open(&handle, probe->device,
+		SND_PCM_STREAM_PLAYBACK, 0
+	);
+	if (err < 0) {
+		log_error("Probe open error: %s", snd_strerror(err));
+		return -1;
+	}
+	int ret = -1;
+	unsigned char *buf = NULL;
+	void **planes = NULL;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_sw_params_alloca(&sw);
+	int dir = 0;
+
+	if (snd_pcm_hw_params_any(handle, hw) < 0
+	|| snd_pcm_hw_params_set_access(handle, hw, probe->access) < 0
+	|| snd_pcm_hw_params_set_format(handle, hw, probe->format) < 0
+	|| snd_pcm_hw_params_set_channels(handle, hw, probe->channels) < 0
+	|| snd_pcm_hw_params_set_rate(handle, hw, rate, 0) < 0
+	|| snd_pcm_hw_params_set_period_size_near(handle, hw, &period,
+		&dir) < 0)
+		goto out;
+	snd_pcm_uframes_t buffer = 2 * period;
+	if (snd_pcm_hw_params_set_buffer_size_near(handle, hw, &buffer) < 0
+	|| snd_pcm_hw_params(handle, hw) < 0)
+		goto out;
+	snd_pcm_hw_params_get_period_size(hw, &period, &dir);
+	snd_pcm_hw_params_get_buffer_size(hw, &buffer);
+	got->period_size = period;
+	got->buffer_size = buffer;
+
+	// start on a full buffer, like aylp_alsa does
+	if (snd_pcm_sw_params_current(handle, sw) < 0
+	|| snd_pcm_sw_params_set_start_threshold(handle, sw,
+		(buffer / period) * period) < 0
+	|| snd_pcm_sw_params(handle, sw) < 0)
+		goto out;
+
+	// a period of silence, which is also one plane per channel
+	size_t bps = snd_pcm_format_physical_width(probe->format) / 8;
+	buf = xcalloc(probe->channels * period, bps);
+	snd_pcm_format_set_silence(probe->format, buf,
+		probe->channels * period
+	);
+	planes = xcalloc(probe->channels, sizeof(void *));
+	for (unsigned c = 0; c < probe->channels; c++)
+		planes[c] = buf + c * period * bps;
+
+	unsigned xruns = 0;
+	long long end = now_ns() + probe->run_ms * 1000000LL;
+	while (now_ns() < end) {
+		snd_pcm_sframes_t res;
+		switch (probe->access) {
+		case SND_PCM_ACCESS_MMAP_INTERLEAVED:
+			res = snd_pcm_mmap_writei(handle, buf, period);
+			break;
+		case SND_PCM_ACCESS_MMAP_NONINTERLEAVED:
+			res = snd_pcm_mmap_writen(handle, planes, period);
+			break;
+		case SND_PCM_ACCESS_RW_NONINTERLEAVED:
+			res = snd_pcm_writen(handle, planes, period);
+			break;
+		default:
+			res = snd_pcm_writei(handle, buf, period);
+			break;
+		}
+		if (res == -EPIPE) {
+			xruns++;
+			if (snd_pcm_prepare(handle) < 0) goto out;
+		} else if (res < 0) {
+			log_warn("Probe write error: %s", snd_strerror(res));
+			goto out;
+		}
+	}
+	log_info("Probe at %u Hz, period %lu, buffer %lu: %u xruns",
+		rate, period, buffer, xruns
+	);
+	ret = !xruns;
+out:
+	snd_pcm_drop(handle);
+	snd_pcm_close(handle);
+	xfree(planes);
+	xfree(buf);
+	return ret;
+}
+
+
+/** Adds the smallest stable period at rate to stable, if there is one. */
+static void find_stable(const struct aylp_alsa_probe *probe, unsigned rate,
+	snd_pcm_uframes_t min, snd_pcm_uframes_t max, json_object *stable
+){
+	if (min < PROBE_MIN_PERIOD) min = PROBE_MIN_PERIOD;
+	if (max > PROBE_MAX_PERIOD) max = PROBE_MAX_PERIOD;
+	snd_pcm_uframes_t last = 0;
+	for (snd_pcm_uframes_t p = min; p <= max; p *= 2) {
+		struct aylp_alsa_profile got = {0};
+		// the device may round several requests to the same period
+		int res = try_period(probe, rate, p, &got);
+		if (res < 0 || got.period_size == last) continue;
+		last = got.period_size;
+		if (!res) continue;
+		json_object *entry = json_object_new_object();
+		json_object_object_add(entry, "rate",
+			json_object_new_uint64(rate)
+		);
+		json_object_object_add(entry, "period_size",
+			json_object_new_uint64(got.period_size)
+		);
+		json_object_object_add(entry, "buffer_size",
+			json_object_new_uint64(got.buffer_size)
+		);
+		json_object_array_add(stable, entry);
+		return;
+	}
+	log_warn("No stable period at %u Hz up to %lu frames", rate, max);
+}
+
+
+int aylp_alsa_probe_run(const struct aylp_alsa_probe *probe, unsigned rate,
+	const char *path
+){
+	snd_pcm_t *handle;
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_hw_params_alloca(&hw);
+	int err = snd_pcm_open(&handle, probe->device,
+		SND_PCM_STREAM_PLAYBACK, 0
+	);
+	if (err < 0) {
+		log_error("Probe open error: %s", snd_strerror(err));
+		return -1;
+	}
+	err = snd_pcm_hw_params_any(handle, hw);
+	if (err < 0) {
+		log_error("No configurations available for %s: %s",
+			probe->device, snd_strerror(err)
+		);
+		snd_pcm_close(handle);
+		return -1;
+	}
+	json_object *root = json_object_new_object();
+	json_object_object_add(root, "device",
+		json_object_new_string(probe->device)
+	);
+	describe(handle, hw, root);
+
+	// the period limits for the configuration we'll actually use
+	snd_pcm_uframes_t pmin = 0, pmax = 0;
+	int dir = 0;
+	bool usable = snd_pcm_hw_params_set_access(handle, hw,
+			probe->access) >= 0
+		&& snd_pcm_hw_params_set_format(handle, hw,
+			probe->format) >= 0
+		&& snd_pcm_hw_params_set_channels(handle, hw,
+			probe->channels) >= 0;
+	if (usable) {
+		snd_pcm_hw_params_get_period_size_min(hw, &pmin, &dir);
+		snd_pcm_hw_params_get_period_size_max(hw, &pmax, &dir);
+	}
+	bool rate_ok[LEN(std_rates)];
+	bool custom_ok = false;
+	for (size_t i = 0; i < LEN(std_rates); i++) {
+		rate_ok[i] = usable && !snd_pcm_hw_params_test_rate(handle,
+			hw, std_rates[i], 0
+		);
+		if (std_rates[i] == rate) rate = 0;
+	}
+	if (usable && rate)
+		custom_ok = !snd_pcm_hw_params_test_rate(handle, hw, rate, 0);
+	snd_pcm_close(handle);
+	if (!usable) {
+		log_warn("%s can't do %s, %s, %u channels; only describing it",
+			probe->device, snd_pcm_access_name(probe->access),
+			snd_pcm_format_name(probe->format), probe->channels
+		);
+	}
+
+	// what the stable periods were measured with
+	json_object_object_add(root, "access",
+		json_object_new_string(snd_pcm_access_name(probe->access))
+	);
+	json_object_object_add(root, "format",
+		json_object_new_string(snd_pcm_format_name(probe->format))
+	);
+	json_object_object_add(root, "probe_channels",
+		json_object_new_uint64(probe->channels)
+	);
+	json_object *stable = json_object_new_array();
+	for (size_t i = 0; i < LEN(std_rates); i++) {
+		if (rate_ok[i])
+			find_stable(probe, std_rates[i], pmin, pmax, stable);
+	}
+	if (custom_ok) find_stable(probe, rate, pmin, pmax, stable);
+	json_object_object_add(root, "stable", stable);
+
+	err = json_object_to_file_ext(path, root, JSON_C_TO_STRING_PRETTY);
+	json_object_put(root);
+	if (err) {
+		log_error("Couldn't write profile to %s", path);
+		return -1;
+	}
+	log_info("Wrote profile for %s to %s", probe->device, path);
+	return 0;
+}
+
+
+/** Checks that obj[key] is the string want. */
+static bool match_string(json_object *obj, const char *key, const char *want)
+{
+	json_object *val;
+	if (!json_object_object_get_ex(obj, key, &val)) return false;
+	const char *s = json_object_get_string(val);
+	return s && want && !strcmp(s, want);
+}
+
+
+int aylp_alsa_profile_load(const char *path,
+	const struct aylp_alsa_probe *probe, unsigned rate,
+	struct aylp_alsa_profile *profile
+){
+	json_object *root = json_object_from_file(path);
+	if (!root) return -1;
+	int ret = -1;
+	json_object *val;
+	if (!match_string(root, "device", probe->device)
+	|| !match_string(root, "access", snd_pcm_access_name(probe->access))
+	|| !match_string(root, "format", snd_pcm_format_name(probe->format))
+	|| !json_object_object_get_ex(root, "probe_channels", &val)
+	|| (unsigned)json_object_get_int(val) != probe->channels) {
+		log_warn("Profile %s was probed with a different device, "
+			"access, format or channel count", path
+		);
+		goto out;
+	}
+	json_object *stable;
+	if (!json_object_object_get_ex(root, "stable", &stable)
+	|| !json_object_is_type(stable, json_type_array))
+		goto out;
+	for (size_t i = 0; i < json_object_array_length(stable); i++) {
+		json_object *entry = json_object_array_get_idx(stable, i);
+		if (!json_object_object_get_ex(entry, "rate", &val)
+		|| (unsigned)json_object_get_int(val) != rate)
+			continue;
+		json_object *period, *buffer;
+		if (!json_object_object_get_ex(entry, "period_size", &period)
+		|| !json_object_object_get_ex(entry, "buffer_size", &buffer))
+			continue;
+		profile->period_size = json_object_get_int64(period);
+		profile->buffer_size = json_object_get_int64(buffer);
+		ret = profile->period_size && profile->buffer_size ? 0 : -1;
+		break;
+	}
+out:
+	json_object_put(root);
+	return ret;
+}
+
@@ -0,0 +1,41 @@
+// device capability probe and tuning profile for aylp_alsa
+#ifndef AYLP_ALSA_PROBE_H_
+#define AYLP_ALSA_PROBE_H_
+
+#include <alsa/asoundlib.h>
+
+// what we play to find the smallest stable period at one rate
+struct aylp_alsa_probe {
+	const char *device;
+	snd_pcm_access_t access;
+	snd_pcm_format_t format;
+	unsigned channels;
+	// how long to play each candidate period for [ms]
+	unsigned run_ms;
+};
+
+// known-good buffer and period for one configuration in a profile
+struct aylp_alsa_profile {
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+};
+
+/** Enumerates what probe->device supports, finds the smallest period that
+ * plays without xruns at each standard rate (and at `rate`, if nonzero), and
+ * writes it all as JSON to path. Returns 0 or -1.
+ */
+int aylp_alsa_probe_run(const struct aylp_alsa_probe *probe, unsigned rate,
+	const char *path
+);
+
+/** Looks up the stable period and buffer for probe's configuration at rate in
+ * the profile at path. Returns 0 if found, or -1 if there's no profile or it
+ * doesn't cover this configuration.
+ */
+int aylp_alsa_profile_load(const char *path,
+	const struct aylp_alsa_probe *probe, unsigned rate,
+	struct aylp_alsa_profile *profile
+);
+
+#endif
+
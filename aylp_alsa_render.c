@@ -0,0 +1,199 @@
+#define _GNU_SOURCE	// for mremap
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "aylp_alsa_render.h"
+
+#define WAV_HEADER_BYTES 44
+
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+
+/** Writes a canonical WAV header for format, or returns -1 if WAV can't hold
+ * it the way the card would get it.
+ */
+static int put_wav_header(unsigned char *p, snd_pcm_format_t format,
+	unsigned channels, unsigned rate
+){
+	int width = snd_pcm_format_width(format);
+	int phys = snd_pcm_format_physical_width(format);
+	bool is_float = snd_pcm_format_float(format) == 1;
+	// WAV is little endian, unsigned at 8 bits and signed above
+	bool ok = width == phys && (width == 8
+		? format == SND_PCM_FORMAT_U8
+		: snd_pcm_format_little_endian(format) == 1
+		&& (is_float || snd_pcm_format_signed(format) == 1));
+	if (!ok) return -1;
+	unsigned block = channels * phys / 8;
+	memcpy(p, "RIFF", 4);
+	put_le32(p + 4, WAV_HEADER_BYTES - 8);
+	memcpy(p + 8, "WAVEfmt ", 8);
+	put_le32(p + 16, 16);
+	put_le16(p + 20, is_float ? 3 : 1);
+	put_le16(p + 22, channels);
+	put_le32(p + 24, rate);
+	put_le32(p + 28, rate * block);
+	put_le16(p + 32, block);
+	put_le16(p + 34, phys);
+	memcpy(p + 36, "data", 4);
+	put_le32(p + 40, 0);
+	return 0;
+}
+
+
+/** Sizes the file for capacity frames and maps it, or remaps it if it's
+ * already mapped. Returns 0 or -1.
+ */
+static int map_frames(struct aylp_alsa_render *r, size_t capacity)
+{
+	size_t bytes = r->header_bytes + capacity * r->frame_bytes;
+	if (ftruncate(r->fd, bytes)) {
+		log_error("Couldn't size render file: %s", strerror(errno));
+		return -1;
+	}
+	void *map = r->map
+		? mremap(r->map, r->map_bytes, bytes, MREMAP_MAYMOVE)
+		: mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+			r->fd, 0
+		);
+	if (map == MAP_FAILED) {
+		log_error("Couldn't map render file: %s", strerror(errno));
+		return -1;
+	}
+	r->map = map;
+	r->map_bytes = bytes;
+	r->capacity = capacity;
+	if (r->ring)
+		r->ring = (struct aylp_alsa_render_header *)r->map;
+	return 0;
+}
+
+
+int aylp_alsa_render_open(struct aylp_alsa_render *r, const char *path,
+	enum aylp_alsa_render_kind kind, snd_pcm_format_t format,
+	unsigned channels, unsigned rate, size_t ring_frames
+){
+	memset(r, 0, sizeof *r);
+	r->kind = kind;
+	r->frame_bytes = channels * snd_pcm_format_physical_width(format) / 8;
+	unsigned char wav[WAV_HEADER_BYTES];
+	if (kind == AYLP_ALSA_RENDER_WAV) {
+		if (put_wav_header(wav, format, channels, rate)) {
+			log_error("WAV can't hold %s as is; render raw instead",
+				snd_pcm_format_name(format)
+			);
+			return -1;
+		}
+		r->header_bytes = WAV_HEADER_BYTES;
+	} else if (kind == AYLP_ALSA_RENDER_RING) {
+		if (!ring_frames) {
+			log_error("A render ring needs a nonzero size");
+			return -1;
+		}
+		r->header_bytes = sizeof(struct aylp_alsa_render_header);
+	}
+	r->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (r->fd < 0) {
+		log_error("Couldn't open render file %s: %s",
+			path, strerror(errno)
+		);
+		return -1;
+	}
+	// files start with a second of room and double from there
+	size_t capacity = kind == AYLP_ALSA_RENDER_RING
+		? ring_frames : rate;
+	if (map_frames(r, capacity)) {
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+	if (kind == AYLP_ALSA_RENDER_WAV) {
+		memcpy(r->map, wav, sizeof wav);
+	} else if (kind == AYLP_ALSA_RENDER_RING) {
+		r->ring = (struct aylp_alsa_render_header *)r->map;
+		*r->ring = (struct aylp_alsa_render_header){
+			.magic = AYLP_ALSA_RENDER_MAGIC,
+			.version = AYLP_ALSA_RENDER_VERSION,
+			.format = format,
+			.channels = channels,
+			.rate = rate,
+			.frame_bytes = r->frame_bytes,
+			.frames = ring_frames,
+		};
+	}
+	return 0;
+}
+
+
+unsigned char *aylp_alsa_render_begin(struct aylp_alsa_render *r,
+	size_t *frames
+){
+	size_t at;
+	if (r->kind == AYLP_ALSA_RENDER_RING) {
+		// up to the end of the ring; the caller comes back for the rest
+		at = r->frames % r->capacity;
+		if (*frames > r->capacity - at) *frames = r->capacity - at;
+	} else {
+		at = r->frames;
+		size_t capacity = r->capacity;
+		while (capacity - at < *frames) capacity *= 2;
+		if (capacity != r->capacity && map_frames(r, capacity))
+			return NULL;
+	}
+	return r->map + r->header_bytes + at * r->frame_bytes;
+}
+
+
+void aylp_alsa_render_commit(struct aylp_alsa_render *r, size_t frames)
+{
+	r->frames += frames;
+	if (r->kind == AYLP_ALSA_RENDER_RING) {
+		// publish the frames only once they're all there
+		atomic_thread_fence(memory_order_release);
+		__atomic_store_n(&r->ring->pos, r->frames, __ATOMIC_RELEASE);
+	} else if (r->kind == AYLP_ALSA_RENDER_WAV) {
+		// keep the sizes current, so a cut-short render still plays;
+		// past 4 GiB, readers that care go by the file size instead
+		uint64_t bytes = r->frames * r->frame_bytes;
+		if (bytes > UINT32_MAX - WAV_HEADER_BYTES)
+			bytes = UINT32_MAX - WAV_HEADER_BYTES;
+		put_le32(r->map + 4, WAV_HEADER_BYTES - 8 + bytes);
+		put_le32(r->map + 40, bytes);
+	}
+}
+
+
+void aylp_alsa_render_close(struct aylp_alsa_render *r)
+{
+	if (!r->map) return;
+	munmap(r->map, r->map_bytes);
+	r->map = NULL;
+	r->ring = NULL;
+	// a file ends where the last frame does
+	if (r->kind != AYLP_ALSA_RENDER_RING && ftruncate(r->fd,
+		r->header_bytes + r->frames * r->frame_bytes
+	)) {
+		log_warn("Couldn't trim render file: %s", strerror(errno));
+	}
+	close(r->fd);
+	r->fd = -1;
+}
+
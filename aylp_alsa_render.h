@@ -0,0 +1,81 @@
+// offline render target for aylp_alsa: a raw or WAV file, or a shared ring
+#ifndef AYLP_ALSA_RENDER_H_
+#define AYLP_ALSA_RENDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+// "AYLPRING" in little endian
+#define AYLP_ALSA_RENDER_MAGIC 0x474e4952504c5941ULL
+#define AYLP_ALSA_RENDER_VERSION 1
+
+enum aylp_alsa_render_kind {
+	// just the interleaved samples, exactly as the card would get them
+	AYLP_ALSA_RENDER_RAW,
+	// the same samples after a 44-byte WAV header
+	AYLP_ALSA_RENDER_WAV,
+	// the latest frames in a fixed-size ring after an
+	// aylp_alsa_render_header, for a live reader (e.g. under /dev/shm)
+	AYLP_ALSA_RENDER_RING,
+};
+
+/* Header of a ring file. Only uint64_t fields, so an external reader can
+ * parse it without our headers. Frame i lives at (i % frames); a reader
+ * should read pos (acquire), copy what it wants of the last `frames` frames
+ * before it, and read pos again to see if any of them were overwritten.
+ */
+struct aylp_alsa_render_header {
+	uint64_t magic;
+	uint64_t version;
+	// snd_pcm_format_t of the samples
+	uint64_t format;
+	uint64_t channels;
+	uint64_t rate;
+	uint64_t frame_bytes;
+	// ring capacity [frames]
+	uint64_t frames;
+	// total frames written so far
+	uint64_t pos;
+};
+
+struct aylp_alsa_render {
+	enum aylp_alsa_render_kind kind;
+	int fd;
+	// the whole file, header included
+	unsigned char *map;
+	size_t map_bytes;
+	size_t header_bytes;
+	size_t frame_bytes;
+	// frames the mapping has room for after the header
+	size_t capacity;
+	// frames written so far
+	uint64_t frames;
+	// the ring's header, or NULL
+	struct aylp_alsa_render_header *ring;
+};
+
+/** Creates (or truncates) path and maps it for writing frames of format,
+ * channels and rate. ring_frames is the ring's capacity; the other kinds grow
+ * as needed. Returns 0 or -1.
+ */
+int aylp_alsa_render_open(struct aylp_alsa_render *r, const char *path,
+	enum aylp_alsa_render_kind kind, snd_pcm_format_t format,
+	unsigned channels, unsigned rate, size_t ring_frames
+);
+
+/** Returns where the next frames go, with *frames cut down to what's
+ * contiguous there, or NULL if the file couldn't grow.
+ */
+unsigned char *aylp_alsa_render_begin(struct aylp_alsa_render *r,
+	size_t *frames
+);
+
+// account for frames written since aylp_alsa_render_begin()
+void aylp_alsa_render_commit(struct aylp_alsa_render *r, size_t frames);
+
+// trim the file to what was written and unmap it
+void aylp_alsa_render_close(struct aylp_alsa_render *r);
+
+#endif
+
@@ -0,0 +1,42 @@
+#include "xalloc.h"
+#include "aylp_alsa_ring.h"
+
+
+void aylp_alsa_ring_init(struct aylp_alsa_ring *ring, size_t n_slots,
+	unsigned channels, size_t cap_frames
+){
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->n_slots = n_slots;
+	ring->cap_frames = cap_frames;
+	ring->slots = xcalloc(n_slots, sizeof(struct aylp_alsa_slot));
+	ring->buf = xcalloc(n_slots * channels * cap_frames, sizeof(double));
+	for (size_t i = 0; i < n_slots; i++)
+		ring->slots[i].data = ring->buf + i * channels * cap_frames;
+}
+
+
+void aylp_alsa_ring_free(struct aylp_alsa_ring *ring)
+{
+	xfree(ring->slots);
+	xfree(ring->buf);
+	ring->slots = NULL;
+	ring->buf = NULL;
+}
+
+
+void aylp_alsa_mailbox_init(struct aylp_alsa_mailbox *mb, size_t n)
+{
+	atomic_init(&mb->seq, 0);
+	mb->after = 0;
+	mb->n = n;
+	mb->values = xcalloc(n, sizeof(double));
+}
+
+
+void aylp_alsa_mailbox_free(struct aylp_alsa_mailbox *mb)
+{
+	xfree(mb->values);
+	mb->values = NULL;
+}
+
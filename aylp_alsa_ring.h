@@ -0,0 +1,127 @@
+// lock-free single-producer/single-consumer ring of sample blocks
+#ifndef AYLP_ALSA_RING_H_
+#define AYLP_ALSA_RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// one entry in the ring
+struct aylp_alsa_slot {
+	// samples, channel-major: data[c * cap_frames + f]
+	double *data;
+	// number of valid frames
+	size_t frames;
+};
+
+struct aylp_alsa_ring {
+	// next slot the producer will fill
+	_Alignas(64) atomic_size_t head;
+	// next slot the consumer will drain
+	_Alignas(64) atomic_size_t tail;
+	// everything below is read-only after init
+	_Alignas(64) size_t n_slots;
+	// capacity of each slot [frames]
+	size_t cap_frames;
+	struct aylp_alsa_slot *slots;
+	double *buf;
+};
+
+/* Latest-value mailbox for held vectors, next to the ring: a newer value
+ * replaces an older one instead of queueing behind it. It's a seqlock, so seq
+ * is odd while the producer writes. `after` is how many slots had been pushed
+ * to the ring when the value was written, so the consumer can tell whether a
+ * block queued after it should win instead.
+ */
+struct aylp_alsa_mailbox {
+	_Alignas(64) atomic_size_t seq;
+	size_t after;
+	// everything below is read-only after init
+	size_t n;
+	double *values;
+};
+
+// allocate n_slots slots of channels x cap_frames each
+void aylp_alsa_ring_init(struct aylp_alsa_ring *ring, size_t n_slots,
+	unsigned channels, size_t cap_frames
+);
+
+// free what aylp_alsa_ring_init() allocated
+void aylp_alsa_ring_free(struct aylp_alsa_ring *ring);
+
+// allocate a mailbox for n values
+void aylp_alsa_mailbox_init(struct aylp_alsa_mailbox *mb, size_t n);
+
+// free what aylp_alsa_mailbox_init() allocated
+void aylp_alsa_mailbox_free(struct aylp_alsa_mailbox *mb);
+
+/** Producer: returns the next free slot, or NULL if the ring is full.
+ * The slot isn't visible to the consumer until aylp_alsa_ring_push().
+ */
+static inline struct aylp_alsa_slot *aylp_alsa_ring_claim(
+	struct aylp_alsa_ring *ring
+){
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail >= ring->n_slots) return NULL;
+	return &ring->slots[head % ring->n_slots];
+}
+
+// producer: publish the slot from the last aylp_alsa_ring_claim()
+static inline void aylp_alsa_ring_push(struct aylp_alsa_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// consumer: returns the oldest published slot, or NULL if the ring is empty
+static inline struct aylp_alsa_slot *aylp_alsa_ring_peek(
+	struct aylp_alsa_ring *ring
+){
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (head == tail) return NULL;
+	return &ring->slots[tail % ring->n_slots];
+}
+
+// consumer: hand the slot from the last aylp_alsa_ring_peek() back
+static inline void aylp_alsa_ring_pop(struct aylp_alsa_ring *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/** Producer: replaces the mailbox's value with x (read every `stride`
+ * doubles), after the ring's slots pushed so far.
+ */
+static inline void aylp_alsa_mailbox_put(struct aylp_alsa_mailbox *mb,
+	const struct aylp_alsa_ring *ring, const double *x, size_t stride
+){
+	size_t seq = atomic_load_explicit(&mb->seq, memory_order_relaxed);
+	atomic_store_explicit(&mb->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	mb->after = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	for (size_t i = 0; i < mb->n; i++) mb->values[i] = x[i * stride];
+	atomic_store_explicit(&mb->seq, seq + 2, memory_order_release);
+}
+
+/** Consumer: copies a value newer than *seen to out and returns true, or
+ * returns false if there's none (or it's being written; try again later).
+ * *after is set to the mailbox's `after`.
+ */
+static inline bool aylp_alsa_mailbox_get(struct aylp_alsa_mailbox *mb,
+	size_t *seen, double *out, size_t *after
+){
+	size_t seq = atomic_load_explicit(&mb->seq, memory_order_acquire);
+	if (seq == *seen || seq & 1) return false;
+	*after = mb->after;
+	for (size_t i = 0; i < mb->n; i++) out[i] = mb->values[i];
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&mb->seq, memory_order_relaxed) != seq)
+		return false;
+	*seen = seq;
+	return true;
+}
+
+#endif
+
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE	// for pthread_setaffinity_np and cpu_set_t
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "xalloc.h"
+#include "aylp_alsa_rt.h"
+
+
+static const char *policy_name(int policy)
+{
+	switch (policy) {
+	case SCHED_OTHER: return "SCHED_OTHER";
+	case SCHED_FIFO: return "SCHED_FIFO";
+	case SCHED_RR: return "SCHED_RR";
+#ifdef SCHED_BATCH
+	case SCHED_BATCH: return "SCHED_BATCH";
+#endif
+#ifdef SCHED_IDLE
+	case SCHED_IDLE: return "SCHED_IDLE";
+#endif
+	default: return "unknown";
+	}
+}
+
+
+int aylp_alsa_rt_parse_policy(const char *name, int *policy)
+{
+	if (!name) return -1;
+	if (!strcmp(name, "other")) {
+		*policy = SCHED_OTHER;
+	} else if (!strcmp(name, "fifo")) {
+		*policy = SCHED_FIFO;
+	} else if (!strcmp(name, "rr")) {
+		*policy = SCHED_RR;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+
+void aylp_alsa_rt_lock(const struct aylp_alsa_rt *rt)
+{
+	if (!rt->mlock) return;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		log_warn("mlockall failed, memory is not locked: %s",
+			strerror(errno)
+		);
+		return;
+	}
+	log_info("Memory locked (mlockall)");
+}
+
+
+void aylp_alsa_rt_apply(const struct aylp_alsa_rt *rt)
+{
+	pthread_t self = pthread_self();
+	int err;
+
+	if (rt->policy != SCHED_OTHER) {
+		int lo = sched_get_priority_min(rt->policy);
+		int hi = sched_get_priority_max(rt->policy);
+		struct sched_param sp = {.sched_priority = rt->priority};
+		if (sp.sched_priority < lo) sp.sched_priority = lo;
+		if (sp.sched_priority > hi) sp.sched_priority = hi;
+		if (sp.sched_priority != rt->priority) {
+			log_warn("Clamped priority %d to [%d, %d]",
+				rt->priority, lo, hi
+			);
+		}
+		err = pthread_setschedparam(self, rt->policy, &sp);
+		if (err) {
+			log_warn("Couldn't set %s: %s",
+				policy_name(rt->policy), strerror(err)
+			);
+		}
+	}
+
+	if (rt->cpus) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned i = 0; i < rt->n_cpus; i++) {
+			if (rt->cpus[i] < CPU_SETSIZE)
+				CPU_SET(rt->cpus[i], &set);
+		}
+		err = pthread_setaffinity_np(self, sizeof set, &set);
+		if (err) {
+			log_warn("Couldn't set CPU affinity: %s",
+				strerror(err)
+			);
+		}
+	}
+
+	// report what we actually got, whether or not we asked for it
+	int policy;
+	struct sched_param sp;
+	if (!pthread_getschedparam(self, &policy, &sp)) {
+		log_info("Audio thread scheduling: %s priority %d",
+			policy_name(policy), sp.sched_priority
+		);
+	}
+	cpu_set_t set;
+	if (!pthread_getaffinity_np(self, sizeof set, &set)) {
+		char buf[256];
+		size_t len = 0;
+		buf[0] = '\0';
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &set)) continue;
+			int n = snprintf(buf + len, sizeof buf - len, "%s%d",
+				len ? "," : "", cpu
+			);
+			if (n < 0 || (size_t)n >= sizeof buf - len) break;
+			len += n;
+		}
+		log_info("Audio thread CPUs: %s (%d of %ld)",
+			buf, CPU_COUNT(&set), sysconf(_SC_NPROCESSORS_ONLN)
+		);
+	}
+}
+
+
+void aylp_alsa_rt_prefault(void *p, size_t len)
+{
+	if (!p || !len) return;
+	size_t page = sysconf(_SC_PAGESIZE);
+	volatile unsigned char *q = p;
+	// rewrite what's there, so this is safe on live buffers
+	for (size_t i = 0; i < len; i += page) q[i] = q[i];
+	q[len-1] = q[len-1];
+}
+
+
+__attribute__((noinline))
+void aylp_alsa_rt_prefault_stack(void)
+{
+	volatile unsigned char buf[AYLP_ALSA_RT_STACK];
+	size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < sizeof buf; i += page) buf[i] = 0;
+}
+
+
+void aylp_alsa_rt_free(struct aylp_alsa_rt *rt)
+{
+	xfree(rt->cpus);
+	rt->cpus = NULL;
+	rt->n_cpus = 0;
+}
+
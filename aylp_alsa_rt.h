@@ -0,0 +1,46 @@
+// real-time scheduling, memory locking and CPU pinning for aylp_alsa
+#ifndef AYLP_ALSA_RT_H_
+#define AYLP_ALSA_RT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct aylp_alsa_rt {
+	// SCHED_OTHER to leave scheduling alone, or SCHED_FIFO/SCHED_RR
+	int policy;
+	// priority for SCHED_FIFO/SCHED_RR
+	int priority;
+	// if true, mlockall() current and future pages
+	bool mlock;
+	// CPUs to pin the audio thread to, or NULL to leave affinity alone
+	unsigned *cpus;
+	unsigned n_cpus;
+	// if true, touch our buffers and stack before we start writing
+	bool prefault;
+};
+
+// parse "other", "fifo" or "rr" into a policy; returns nonzero if unknown
+int aylp_alsa_rt_parse_policy(const char *name, int *policy);
+
+/** Locks our memory if asked to, and reports if it took effect.
+ * This is process-wide, so call it once from init.
+ */
+void aylp_alsa_rt_lock(const struct aylp_alsa_rt *rt);
+
+/** Applies the scheduling policy and CPU affinity to the calling thread, which
+ * should be the one doing the pcm writes, then reports what's in effect.
+ * Failures (e.g. no CAP_SYS_NICE) are logged and otherwise ignored.
+ */
+void aylp_alsa_rt_apply(const struct aylp_alsa_rt *rt);
+
+// touch every page of [p, p+len) so we don't fault on it later
+void aylp_alsa_rt_prefault(void *p, size_t len);
+
+// touch the next AYLP_ALSA_RT_STACK bytes of the calling thread's stack
+void aylp_alsa_rt_prefault_stack(void);
+#define AYLP_ALSA_RT_STACK (64 * 1024)
+
+void aylp_alsa_rt_free(struct aylp_alsa_rt *rt);
+
+#endif
+
@@ -0,0 +1,62 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "aylp_alsa_stats.h"
+
+
+struct aylp_alsa_stats_block *aylp_alsa_stats_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		log_error("Couldn't open stats file %s: %s",
+			path, strerror(errno)
+		);
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(struct aylp_alsa_stats_block))) {
+		log_error("Couldn't size stats file %s: %s",
+			path, strerror(errno)
+		);
+		close(fd);
+		return NULL;
+	}
+	struct aylp_alsa_stats_block *block = mmap(NULL,
+		sizeof(struct aylp_alsa_stats_block), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0
+	);
+	close(fd);
+	if (block == MAP_FAILED) {
+		log_error("Couldn't map stats file %s: %s",
+			path, strerror(errno)
+		);
+		return NULL;
+	}
+	memset(block, 0, sizeof *block);
+	block->magic = AYLP_ALSA_STATS_MAGIC;
+	block->version = AYLP_ALSA_STATS_VERSION;
+	return block;
+}
+
+
+void aylp_alsa_stats_publish(struct aylp_alsa_stats_block *block,
+	const struct aylp_alsa_stats *stats, uint64_t time_ns
+){
+	uint64_t seq = block->seq;
+	__atomic_store_n(&block->seq, seq + 1, __ATOMIC_RELAXED);
+	atomic_thread_fence(memory_order_release);
+	block->time_ns = time_ns;
+	memcpy(&block->stats, stats, sizeof *stats);
+	__atomic_store_n(&block->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+void aylp_alsa_stats_close(struct aylp_alsa_stats_block *block)
+{
+	if (block) munmap(block, sizeof *block);
+}
+
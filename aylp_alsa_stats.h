@@ -0,0 +1,94 @@
+// xrun, latency and timing statistics for aylp_alsa
+#ifndef AYLP_ALSA_STATS_H_
+#define AYLP_ALSA_STATS_H_
+
+#include <stdint.h>
+
+// "AYLPSTAT" in little endian
+#define AYLP_ALSA_STATS_MAGIC 0x54415453504c5941ULL
+#define AYLP_ALSA_STATS_VERSION 2
+#define AYLP_ALSA_HIST_BINS 32
+
+/* log2 histogram. bins[0] counts zeros and bins[i] counts values in
+ * [2^(i-1), 2^i), with everything larger landing in the last bin.
+ */
+struct aylp_alsa_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bins[AYLP_ALSA_HIST_BINS];
+};
+
+struct aylp_alsa_stats {
+	// underruns (including ones the card played through) and other -EPIPE
+	// errors
+	uint64_t xruns;
+	// suspend events
+	uint64_t suspends;
+	// times we started the pcm after the first
+	uint64_t restarts;
+	// calls to process_period() that wrote something
+	uint64_t periods;
+	// total frames written
+	uint64_t frames;
+	// frames of blocks dropped because the writer thread's ring was full
+	uint64_t drops;
+	// snd_pcm_avail_update() on entry to process_period() [frames]
+	struct aylp_alsa_hist avail;
+	// snd_pcm_delay() on entry to process_period() [frames]
+	struct aylp_alsa_hist delay;
+	// time spent waiting for room in the buffer [ns]
+	struct aylp_alsa_hist wait_ns;
+	// time spent converting and committing one period [ns]
+	struct aylp_alsa_hist fill_ns;
+};
+
+/* What we publish. Only uint64_t fields, so an external reader can parse it
+ * without our headers. seq is odd while we're writing; readers should retry
+ * until they see the same even seq before and after reading stats.
+ */
+struct aylp_alsa_stats_block {
+	uint64_t magic;
+	uint64_t version;
+	uint64_t seq;
+	// CLOCK_MONOTONIC time of the last publish [ns]
+	uint64_t time_ns;
+	struct aylp_alsa_stats stats;
+};
+
+static inline void aylp_alsa_hist_add(struct aylp_alsa_hist *h, uint64_t v)
+{
+	unsigned bin = v ? 64 - __builtin_clzll(v) : 0;
+	if (bin >= AYLP_ALSA_HIST_BINS) bin = AYLP_ALSA_HIST_BINS - 1;
+	h->bins[bin]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max) h->max = v;
+}
+
+/** Counts an underrun if avail, as read from a running pcm, is more than the
+ * buffer holds: with the stop threshold at the boundary, the card doesn't
+ * stop or report -EPIPE when it runs dry, it just plays on past what we wrote.
+ * Returns how many frames past, or 0.
+ */
+static inline uint64_t aylp_alsa_stats_underrun(struct aylp_alsa_stats *stats,
+	int64_t avail, uint64_t buffer_size
+){
+	if (avail <= 0 || (uint64_t)avail <= buffer_size) return 0;
+	stats->xruns++;
+	return avail - buffer_size;
+}
+
+// map a stats block at path (e.g. under /dev/shm), or return NULL
+struct aylp_alsa_stats_block *aylp_alsa_stats_open(const char *path);
+
+// copy stats into the block
+void aylp_alsa_stats_publish(struct aylp_alsa_stats_block *block,
+	const struct aylp_alsa_stats *stats, uint64_t time_ns
+);
+
+// unmap the block (the file stays behind for readers)
+void aylp_alsa_stats_close(struct aylp_alsa_stats_block *block);
+
+#endif
+
@@ -0,0 +1,139 @@
+#include <math.h>
+#include <string.h>
+
+#include "xalloc.h"
+#include "aylp_alsa_synth.h"
+
+#define TABLE_SIZE (1u << AYLP_ALSA_SYNTH_TABLE_BITS)
+// bits of the accumulator below the table index
+#define FRAC_BITS (32 - AYLP_ALSA_SYNTH_TABLE_BITS)
+
+// the same GNU vector extensions as aylp_alsa_conv.c; the table lookups are
+// still scalar gathers, but the phase and interpolation math isn't
+#if defined(__GNUC__)
+#define SYNTH_SIMD 1
+#define SYNTH_VLEN 4
+typedef double v_dbl __attribute__((vector_size(SYNTH_VLEN * sizeof(double))));
+typedef uint32_t v_u32
+	__attribute__((vector_size(SYNTH_VLEN * sizeof(uint32_t))));
+#else
+#define SYNTH_SIMD 0
+#endif
+
+
+/** Converts a fraction of a turn to accumulator units, wrapping to [0, 1). */
+static uint32_t to_turns(double turns)
+{
+	turns -= floor(turns);
+	return (uint32_t)(uint64_t)llround(turns * 4294967296.0);
+}
+
+
+void aylp_alsa_synth_init(struct aylp_alsa_synth *s, unsigned channels,
+	unsigned rate, size_t max_frames
+){
+	s->channels = channels;
+	s->rate = rate;
+	s->max_frames = max_frames;
+	s->acc = xcalloc(channels, sizeof(uint32_t));
+	s->inc = xcalloc(channels, sizeof(uint32_t));
+	s->phase = xcalloc(channels, sizeof(uint32_t));
+	s->amp = xcalloc(channels, sizeof(double));
+	s->offset = xcalloc(channels, sizeof(double));
+	s->table = xcalloc(TABLE_SIZE + 1, sizeof(double));
+	for (unsigned i = 0; i < TABLE_SIZE; i++)
+		s->table[i] = sin(2 * M_PI * i / TABLE_SIZE);
+	s->table[TABLE_SIZE] = s->table[0];
+	s->planes = xcalloc(channels * max_frames, sizeof(double));
+	s->out = xcalloc(max_frames * channels, sizeof(double));
+}
+
+
+void aylp_alsa_synth_free(struct aylp_alsa_synth *s)
+{
+	xfree(s->acc);
+	xfree(s->inc);
+	xfree(s->phase);
+	xfree(s->amp);
+	xfree(s->offset);
+	xfree(s->table);
+	xfree(s->planes);
+	xfree(s->out);
+	s->out = NULL;
+}
+
+
+void aylp_alsa_synth_set(struct aylp_alsa_synth *s, const double *x,
+	size_t stride
+){
+	for (unsigned c = 0; c < s->channels; c++) {
+		const double *p = x + c * AYLP_ALSA_SYNTH_PARAMS * stride;
+		s->inc[c] = to_turns(p[0] / s->rate);
+		s->amp[c] = p[stride];
+		s->phase[c] = to_turns(p[2*stride] / (2 * M_PI));
+		s->offset[c] = p[3*stride];
+	}
+}
+
+
+/** Renders n frames of channel c to dst, which is contiguous. */
+static void run_channel(const struct aylp_alsa_synth *s, unsigned c,
+	double *restrict dst, size_t n
+){
+	const double *restrict table = s->table;
+	const double scale = 1.0 / (1u << FRAC_BITS);
+	uint32_t p = s->acc[c] + s->phase[c];
+	const uint32_t inc = s->inc[c];
+	const double amp = s->amp[c], offset = s->offset[c];
+	size_t f = 0;
+#if SYNTH_SIMD
+	// SYNTH_VLEN frames at a time, each lane a frame further on
+	const v_u32 frac_mask = {
+		(1u << FRAC_BITS) - 1, (1u << FRAC_BITS) - 1,
+		(1u << FRAC_BITS) - 1, (1u << FRAC_BITS) - 1,
+	};
+	v_u32 pv = {p, p + inc, p + 2*inc, p + 3*inc};
+	const uint32_t step = SYNTH_VLEN * inc;
+	for (; f + SYNTH_VLEN <= n; f += SYNTH_VLEN, pv += step) {
+		v_u32 i = pv >> FRAC_BITS;
+		v_dbl t = __builtin_convertvector(pv & frac_mask, v_dbl)
+			* scale;
+		v_dbl a, b;
+		for (int k = 0; k < SYNTH_VLEN; k++) {
+			a[k] = table[i[k]];
+			b[k] = table[i[k] + 1];
+		}
+		v_dbl v = offset + amp * (a + t * (b - a));
+		memcpy(dst + f, &v, sizeof v);
+	}
+	p = pv[0];
+#endif
+	for (; f < n; f++, p += inc) {
+		uint32_t i = p >> FRAC_BITS;
+		double t = (p & ((1u << FRAC_BITS) - 1)) * scale;
+		double v = table[i] + t * (table[i+1] - table[i]);
+		dst[f] = offset + amp * v;
+	}
+}
+
+
+void aylp_alsa_synth_run(struct aylp_alsa_synth *s, size_t n)
+{
+	const unsigned C = s->channels;
+	for (unsigned c = 0; c < C; c++)
+		run_channel(s, c, s->planes + c * s->max_frames, n);
+	// interleave once, a frame at a time, so the stores are contiguous
+	double *restrict out = s->out;
+	for (size_t f = 0; f < n; f++) {
+		for (unsigned c = 0; c < C; c++)
+			out[f*C + c] = s->planes[c * s->max_frames + f];
+	}
+}
+
+
+void aylp_alsa_synth_advance(struct aylp_alsa_synth *s, size_t n)
+{
+	for (unsigned c = 0; c < s->channels; c++)
+		s->acc[c] += (uint32_t)(s->inc[c] * (uint64_t)n);
+}
+
@@ -0,0 +1,64 @@
+// oscillator bank for aylp_alsa's synth mode
+#ifndef AYLP_ALSA_SYNTH_H_
+#define AYLP_ALSA_SYNTH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// pipeline elements per channel: frequency [Hz], amplitude, phase [rad], offset
+#define AYLP_ALSA_SYNTH_PARAMS 4
+// log2 of the number of entries in the sine table
+#define AYLP_ALSA_SYNTH_TABLE_BITS 12
+
+/* One numerically controlled oscillator per channel. Each has a 32-bit phase
+ * accumulator (a full turn is 2^32) that wraps for free; the top bits index a
+ * sine table and the rest interpolate linearly between entries, which is good
+ * to about -130 dB. Changing the frequency keeps the accumulator, so
+ * frequency steps are phase-continuous, and the phase parameter is added on
+ * top of it.
+ */
+struct aylp_alsa_synth {
+	unsigned channels;
+	unsigned rate;
+	// most frames one aylp_alsa_synth_run() can render
+	size_t max_frames;
+	// per-channel accumulator, increment per frame and phase offset
+	uint32_t *acc;
+	uint32_t *inc;
+	uint32_t *phase;
+	double *amp;
+	double *offset;
+	// one turn of sine, plus a copy of the first entry to interpolate to
+	double *table;
+	// per-channel scratch, channels x max_frames (channel-major), so each
+	// oscillator renders to contiguous memory
+	double *planes;
+	// output, max_frames x channels (frame-major)
+	double *out;
+};
+
+void aylp_alsa_synth_init(struct aylp_alsa_synth *s, unsigned channels,
+	unsigned rate, size_t max_frames
+);
+
+// free what aylp_alsa_synth_init() allocated
+void aylp_alsa_synth_free(struct aylp_alsa_synth *s);
+
+/** Sets every channel's frequency, amplitude, phase and offset from x, which
+ * has AYLP_ALSA_SYNTH_PARAMS elements per channel, `stride` doubles apart.
+ */
+void aylp_alsa_synth_set(struct aylp_alsa_synth *s, const double *x,
+	size_t stride
+);
+
+/** Renders n <= s->max_frames frames from the current phase to s->out,
+ * without advancing it, so frames that never get written can be rendered
+ * again.
+ */
+void aylp_alsa_synth_run(struct aylp_alsa_synth *s, size_t n);
+
+// advance the oscillators past n frames
+void aylp_alsa_synth_advance(struct aylp_alsa_synth *s, size_t n);
+
+#endif
+
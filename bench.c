@@ -0,0 +1,146 @@
+/* Headless benchmark of the aylp_alsa process path.
+ * Runs aylp_alsa_init()/aylp_alsa_process() against a pcm that never blocks
+ * (ALSA's "null" device by default, or e.g. a file pcm given as argv[1]) and
+ * sweeps format, channel count, period size and access mode.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include <json-c/json.h>
+#include <gsl/gsl_vector.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "anyloop.h"
+#include "aylp_alsa.h"
+
+#define RATE 200000
+// frames to write per configuration
+#define BENCH_FRAMES 2000000
+
+static const char *formats[] = {"S16_LE", "S24_3LE", "S32_LE", "FLOAT_LE"};
+static const unsigned channel_counts[] = {1, 2, 8};
+static const unsigned period_sizes[] = {64, 256, 1024};
+static const char *accesses[] = {
+	"MMAP_INTERLEAVED", "MMAP_NONINTERLEAVED",
+	"RW_INTERLEAVED", "RW_NONINTERLEAVED",
+};
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void)
+{
+#if HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+
+/** Runs one configuration and prints a result row. Returns 0 on success. */
+static int bench_one(const char *device, const char *format,
+	unsigned channels, unsigned period, const char *access
+){
+	json_object *params = json_object_new_object();
+	json_object_object_add(params, "device",
+		json_object_new_string(device)
+	);
+	json_object_object_add(params, "format",
+		json_object_new_string(format)
+	);
+	json_object_object_add(params, "access",
+		json_object_new_string(access)
+	);
+	json_object_object_add(params, "channels",
+		json_object_new_int64(channels)
+	);
+	json_object_object_add(params, "rate", json_object_new_int64(RATE));
+	// two periods per buffer
+	json_object_object_add(params, "latency_target_us",
+		json_object_new_int64(2ULL * period * 1000000 / RATE)
+	);
+	struct aylp_device dev = {.params = params};
+	if (aylp_alsa_init(&dev)) {
+		fprintf(stderr, "init failed for %s %u ch %u frames %s\n",
+			format, channels, period, access
+		);
+		json_object_put(params);
+		return -1;
+	}
+	struct aylp_alsa_data *data = dev.device_data;
+
+	gsl_vector *vec = gsl_vector_alloc(channels);
+	for (unsigned c = 0; c < channels; c++)
+		gsl_vector_set(vec, c, 0.5 - (double)c / channels);
+	struct aylp_state state = {.vector = vec};
+	state.header.type = AYLP_T_VECTOR;
+
+	// warm up, then measure
+	aylp_alsa_process(&dev, &state);
+	unsigned long long frames0 = data->stats.frames;
+	unsigned long long periods0 = data->stats.periods;
+	long long t0 = now_ns();
+	unsigned long long c0 = cycles();
+	unsigned stalls = 0;
+	while (data->stats.frames - frames0 < BENCH_FRAMES && stalls < 1000) {
+		unsigned long long before = data->stats.frames;
+		// nudge the input so nothing can cache it
+		vec->data[0] = -vec->data[0];
+		if (aylp_alsa_process(&dev, &state)) break;
+		stalls = data->stats.frames == before ? stalls + 1 : 0;
+	}
+	unsigned long long c1 = cycles();
+	long long t1 = now_ns();
+
+	unsigned long long frames = data->stats.frames - frames0;
+	unsigned long long periods = data->stats.periods - periods0;
+	unsigned long long samples = frames * channels;
+	printf("%-9s %3u %6lu %-20s %10.1f %8.3f", format, channels,
+		data->period_size, access,
+		periods ? (double)(t1 - t0) / periods : 0.0,
+		samples ? (double)(t1 - t0) / samples : 0.0
+	);
+	if (HAVE_TSC && samples)
+		printf(" %8.3f\n", (double)(c1 - c0) / samples);
+	else
+		printf(" %8s\n", "n/a");
+
+	aylp_alsa_close(&dev);
+	gsl_vector_free(vec);
+	json_object_put(params);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *device = argc > 1 ? argv[1] : "null";
+	int failed = 0;
+	printf("%-9s %3s %6s %-20s %10s %8s %8s\n", "format", "ch", "period",
+		"access", "ns/period", "ns/samp", "cyc/samp"
+	);
+	for (size_t f = 0; f < LEN(formats); f++)
+	for (size_t c = 0; c < LEN(channel_counts); c++)
+	for (size_t p = 0; p < LEN(period_sizes); p++)
+	for (size_t a = 0; a < LEN(accesses); a++) {
+		if (bench_one(device, formats[f], channel_counts[c],
+			period_sizes[p], accesses[a]
+		)) failed++;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Print the stats block that aylp_alsa publishes at its stats_path."""
+
+import mmap
+import struct
+import sys
+import time
+
+MAGIC = 0x54415453504C5941
+BINS = 32
+COUNTERS = ["xruns", "suspends", "restarts", "periods", "frames", "drops"]
+HISTS = ["avail", "delay", "wait_ns", "fill_ns"]
+N_WORDS = 4 + len(COUNTERS) + len(HISTS) * (3 + BINS)
+
+
+def read_block(path):
+    with open(path, "rb") as f:
+        m = mmap.mmap(f.fileno(), N_WORDS * 8, access=mmap.ACCESS_READ)
+    with m:
+        if struct.unpack_from("<Q", m, 0)[0] != MAGIC:
+            sys.exit(f"{path}: bad magic")
+        while True:
+            # seqlock: an odd seq, or one that changed while we copied,
+            # means we caught a publish in progress
+            seq = struct.unpack_from("<Q", m, 16)[0]
+            words = struct.unpack_from(f"<{N_WORDS}Q", m, 0)
+            if seq % 2 == 0 and struct.unpack_from("<Q", m, 16)[0] == seq:
+                return words[1], words[3], words[4:]
+            time.sleep(0.001)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(f"usage: {sys.argv[0]} STATS_PATH")
+    version, time_ns, words = read_block(sys.argv[1])
+    print(f"version {version}, published at {time_ns / 1e9:.3f} s")
+    for name, val in zip(COUNTERS, words):
+        print(f"{name}: {val}")
+    words = words[len(COUNTERS):]
+    for name in HISTS:
+        count, total, peak = words[:3]
+        bins = words[3:3 + BINS]
+        words = words[3 + BINS:]
+        mean = total / count if count else 0
+        print(f"{name}: n={count} mean={mean:.1f} max={peak}")
+        for i, n in enumerate(bins):
+            if n:
+                lo = 0 if i == 0 else 1 << (i - 1)
+                print(f"  >= {lo:>10}: {n}")
+
+
+if __name__ == "__main__":
+    main()
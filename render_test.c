@@ -0,0 +1,202 @@
+/* Test of what aylp_alsa writes, through render.
+ * Runs short pipelines through aylp_alsa_init()/aylp_alsa_process() with
+ * render set to a temp file and checks the samples against what hold, pace,
+ * interp and wavetable should give. The renders are FLOAT64_LE, so each sample
+ * is just the clamped input at the plugin's usual half scale.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <json-c/json.h>
+#include <gsl/gsl_vector.h>
+
+#include "anyloop.h"
+#include "aylp_alsa.h"
+
+#define RATE 64000
+#define CHANNELS 2
+// latency_target_us 2000 gives a buffer of two 64-frame periods
+#define PERIOD 64
+#define MAX_FRAMES 1024
+
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static char path[] = "/tmp/aylp_alsa_render_test_XXXXXX";
+
+
+/** Runs n_vecs vectors of width elements from vecs through a render set up
+ * with params_json plus the params every test shares, and reads the samples
+ * back into out. Returns the number of frames, or -1.
+ */
+static long render(const char *params_json, const double *vecs, size_t n_vecs,
+	size_t width, double *out
+){
+	json_object *params = json_tokener_parse(params_json);
+	if (!params) {
+		fprintf(stderr, "Bad params: %s\n", params_json);
+		return -1;
+	}
+	json_object_object_add(params, "render", json_object_new_string(path));
+	json_object_object_add(params, "format",
+		json_object_new_string("FLOAT64_LE")
+	);
+	json_object_object_add(params, "channels",
+		json_object_new_int64(CHANNELS)
+	);
+	json_object_object_add(params, "rate", json_object_new_int64(RATE));
+	json_object_object_add(params, "latency_target_us",
+		json_object_new_int64(2000)
+	);
+	struct aylp_device dev = {.params = params};
+	if (aylp_alsa_init(&dev)) {
+		fprintf(stderr, "init failed for %s\n", params_json);
+		json_object_put(params);
+		return -1;
+	}
+	gsl_vector *vec = gsl_vector_alloc(width);
+	struct aylp_state state = {.vector = vec};
+	state.header.type = AYLP_T_VECTOR;
+	int err = 0;
+	for (size_t i = 0; i < n_vecs && !err; i++) {
+		for (size_t k = 0; k < width; k++)
+			gsl_vector_set(vec, k, vecs[i * width + k]);
+		err = aylp_alsa_process(&dev, &state);
+	}
+	aylp_alsa_close(&dev);
+	gsl_vector_free(vec);
+	json_object_put(params);
+	if (err) {
+		fprintf(stderr, "process failed for %s\n", params_json);
+		return -1;
+	}
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	size_t n = fread(out, CHANNELS * sizeof(double), MAX_FRAMES, f);
+	fclose(f);
+	return n;
+}
+
+
+/** Compares frames frames of got against want_frames frames of want, and
+ * reports the first difference. Returns 0 if they match.
+ */
+static int check(const char *name, const double *got, long frames,
+	const double *want, long want_frames
+){
+	if (frames != want_frames) {
+		fprintf(stderr, "FAIL %s: %ld frames, expected %ld\n",
+			name, frames, want_frames
+		);
+		return 1;
+	}
+	for (long i = 0; i < frames * CHANNELS; i++) {
+		if (fabs(got[i] - want[i]) > 1e-12) {
+			fprintf(stderr, "FAIL %s: frame %ld channel %ld is %g, "
+				"expected %g\n", name, i / CHANNELS,
+				i % CHANNELS, got[i], want[i]
+			);
+			return 1;
+		}
+	}
+	printf("ok %s: %ld frames\n", name, frames);
+	return 0;
+}
+
+
+// each held vector is a period of the same frame; 1.5 clamps to full scale
+static int test_hold(void)
+{
+	static const double vecs[] = {0.5, -0.25, 1.5, 0.0};
+	double got[MAX_FRAMES * CHANNELS], want[2 * PERIOD * CHANNELS];
+	long frames = render("{}", vecs, 2, CHANNELS, got);
+	for (long f = 0; f < 2 * PERIOD; f++) {
+		want[f*CHANNELS] = f < PERIOD ? 0.25 : 0.5;
+		want[f*CHANNELS + 1] = f < PERIOD ? -0.125 : 0.0;
+	}
+	return check("hold", got, frames, want, 2 * PERIOD);
+}
+
+
+// with pace, each held vector is exactly pace frames instead
+static int test_pace(void)
+{
+	static const double vecs[] = {0.5, -0.25, -1.0, 1.0, 0.0, 0.5};
+	double got[MAX_FRAMES * CHANNELS], want[3 * 10 * CHANNELS];
+	long frames = render("{\"pace\": 10}", vecs, 3, CHANNELS, got);
+	for (long f = 0; f < 3 * 10; f++) {
+		for (unsigned c = 0; c < CHANNELS; c++) {
+			want[f*CHANNELS + c] = 0.5
+				* vecs[f / 10 * CHANNELS + c];
+		}
+	}
+	return check("pace", got, frames, want, 3 * 10);
+}
+
+
+// linear interp holds the first vector, then ramps to each next one, landing
+// on it exactly on the last frame
+static int test_interp(void)
+{
+	static const double vecs[] = {0.0, 1.0, 1.0, 0.0};
+	double got[MAX_FRAMES * CHANNELS], want[2 * 4 * CHANNELS];
+	long frames = render(
+		"{\"interp\": \"linear\", \"interp_frames\": 4}",
+		vecs, 2, CHANNELS, got
+	);
+	for (long f = 0; f < 4; f++) {
+		double t = (f + 1) / 4.0;
+		want[f*CHANNELS] = 0.0;
+		want[f*CHANNELS + 1] = 0.5;
+		want[(4 + f)*CHANNELS] = 0.5 * t;
+		want[(4 + f)*CHANNELS + 1] = 0.5 * (1 - t);
+	}
+	return check("interp", got, frames, want, 2 * 4);
+}
+
+
+// a wavetable loops per channel, scaled by each vector's gain and offset
+static int test_wavetable(void)
+{
+	static const double table[CHANNELS][4] = {
+		{0.0, 0.5, 1.0, 0.5},
+		{1.0, 0.0, -1.0, 0.0},
+	};
+	// gain and offset per channel
+	static const double vecs[] = {1.0, 0.0, 0.5, 0.25};
+	double got[MAX_FRAMES * CHANNELS], want[PERIOD * CHANNELS];
+	long frames = render(
+		"{\"wavetable\": [[0, 0.5, 1, 0.5], [1, 0, -1, 0]]}",
+		vecs, 1, 2 * CHANNELS, got
+	);
+	for (long f = 0; f < PERIOD; f++) {
+		for (unsigned c = 0; c < CHANNELS; c++) {
+			want[f*CHANNELS + c] = 0.5 * (vecs[2*c + 1]
+				+ vecs[2*c] * table[c][f % 4]);
+		}
+	}
+	return check("wavetable", got, frames, want, PERIOD);
+}
+
+
+int main(void)
+{
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	int (*const tests[])(void) = {
+		test_hold, test_pace, test_interp, test_wavetable,
+	};
+	int failed = 0;
+	for (size_t i = 0; i < LEN(tests); i++) failed += tests[i]();
+	unlink(path);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
@@ -0,0 +1,96 @@
+/* Test of the underrun accounting behind aylp_alsa's xruns counter.
+ * The null and render backends never run dry, so this starves a simulated
+ * card instead: a hw pointer that plays on at a fixed rate (as a real one does
+ * with the stop threshold at the boundary) while we write less than it plays.
+ * The counter is read back through a published stats file, the way
+ * contrib/aylp_alsa_stats.py would see it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aylp_alsa_stats.h"
+
+#define BUFFER 1024
+#define PERIOD 256
+
+
+/** Runs ticks periods of a card that plays PERIOD frames per tick while we
+ * write `write` frames per tick, handling underruns the way aylp_alsa does,
+ * and returns the xruns counter as published to path.
+ */
+static uint64_t run(const char *path, unsigned ticks, int64_t write)
+{
+	struct aylp_alsa_stats_block *block = aylp_alsa_stats_open(path);
+	if (!block) exit(1);
+	struct aylp_alsa_stats stats = {0};
+	// start full, like the pcm does
+	int64_t hw = 0, appl = BUFFER;
+	for (unsigned t = 0; t < ticks; t++) {
+		hw += PERIOD;
+		int64_t avail = BUFFER - (appl - hw);
+		uint64_t over = aylp_alsa_stats_underrun(&stats, avail, BUFFER);
+		// snd_pcm_forward() past what has played
+		appl += over;
+		avail -= over;
+		if (avail > BUFFER) {
+			fprintf(stderr, "avail %lld after skipping\n",
+				(long long)avail
+			);
+			exit(1);
+		}
+		appl += write < avail ? write : avail;
+		aylp_alsa_stats_publish(block, &stats, t);
+	}
+	aylp_alsa_stats_close(block);
+
+	struct aylp_alsa_stats_block read;
+	FILE *f = fopen(path, "rb");
+	if (!f || fread(&read, sizeof read, 1, f) != 1) {
+		fprintf(stderr, "Couldn't read back %s\n", path);
+		exit(1);
+	}
+	fclose(f);
+	if (read.magic != AYLP_ALSA_STATS_MAGIC || read.seq & 1) {
+		fprintf(stderr, "Bad stats block in %s\n", path);
+		exit(1);
+	}
+	return read.stats.xruns;
+}
+
+
+int main(void)
+{
+	char path[] = "/tmp/aylp_alsa_stats_test_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	int ret = 0;
+
+	uint64_t fed = run(path, 100, PERIOD);
+	if (fed) {
+		fprintf(stderr, "FAIL: %llu xruns with the card kept fed\n",
+			(unsigned long long)fed
+		);
+		ret = 1;
+	}
+	// half a period short each time: the buffer drains in 8 ticks and
+	// runs dry on every tick after that
+	uint64_t starved = run(path, 100, PERIOD / 2);
+	if (!starved) {
+		fprintf(stderr, "FAIL: no xruns with the card starved\n");
+		ret = 1;
+	}
+	if (!ret) {
+		printf("ok: %llu xruns fed, %llu starved\n",
+			(unsigned long long)fed, (unsigned long long)starved
+		);
+	}
+	unlink(path);
+	return ret;
+}
+